@@ -0,0 +1,71 @@
+// Measures the memory used per key as a set churns.  It inserts n
+// keys and then, for each of r rounds, inserts n new keys while
+// removing the n keys of the previous round, in parallel.  The keys of
+// each round are dense in their own region of the key space, so the
+// nodes for the keys of a round fill up and then drain once the round
+// is removed.  Finally it removes all but a tenth of the keys.  After
+// each phase it reports the throughput and the bytes used by the
+// structure per key it holds.
+
+#include <iostream>
+#include <iomanip>
+#include <parlay/primitives.h>
+#include <parlay/internal/get_time.h>
+#include <flock/flock.h>
+#include "parse_command_line.h"
+
+using K = unsigned long;
+using V = unsigned long;
+#include "set.h"
+
+using Table = decltype(std::declval<Set<K,V>>().empty(0));
+
+int main(int argc, char* argv[]) {
+  commandLine P(argc,argv,"[-n <num keys>] [-r <rounds>]");
+  size_t n = P.getOptionLongValue("-n", 1000000);
+  int rounds = P.getOptionIntValue("-r", 5);
+
+  // the keys of round r are distinct and taken from [r * 2^40, r * 2^40 + 4n)
+  auto round_keys = [&] (int r) {
+    auto keys = parlay::remove_duplicates(parlay::tabulate(n, [&] (size_t i) {
+	  return (((K) r) << 40) + parlay::hash64(r * n + i) % (4 * n);}));
+    return parlay::random_shuffle(keys);};
+
+  Set<K,V> os;
+  Table tr = os.empty(n);
+
+  auto report = [&] (const char* name, size_t ops, double duration) {
+    size_t cnt = os.check(tr);
+    std::cout << std::setprecision(4)
+	      << P.commandName() << ","
+	      << name << ","
+	      << "ops=" << ops << ","
+	      << "keys=" << cnt << ","
+	      << "bytes/key=" << ((double) os.bytes_used(tr)) / cnt << ","
+	      << ops / (duration * 1e6) << std::endl;};
+
+  parlay::internal::timer t;
+  auto keys = round_keys(0);
+  parlay::parallel_for(0, keys.size(), [&] (size_t i) {
+      os.insert(tr, keys[i], i);});
+  report("insert", keys.size(), t.stop());
+
+  for (int r = 1; r <= rounds; r++) {
+    auto new_keys = round_keys(r);
+    size_t m = std::max(keys.size(), new_keys.size());
+    t.start();
+    parlay::parallel_for(0, m, [&] (size_t i) {
+	if (i < new_keys.size()) os.insert(tr, new_keys[i], i);
+	if (i < keys.size()) os.remove(tr, keys[i]);});
+    report("churn", keys.size() + new_keys.size(), t.stop());
+    keys = std::move(new_keys);
+  }
+
+  t.start();
+  size_t m = keys.size() - keys.size() / 10;
+  parlay::parallel_for(0, m, [&] (size_t i) {os.remove(tr, keys[i]);});
+  report("remove_90%", m, t.stop());
+
+  os.retire(tr);
+  os.clear();
+}
@@ -0,0 +1,103 @@
+// Grows a resizable hash table from an initial size (1K keys by
+// default) to n keys (100M by default), inserting 10x more keys in
+// each phase, and then shrinks it by removing them again in the same
+// phases.  For each phase it reports the throughput, the table size
+// and the p50, p99 and maximum latency of the operations, in
+// nanoseconds, over a sample of them.
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <parlay/primitives.h>
+#include <parlay/internal/get_time.h>
+#include <flock/flock.h>
+#include "parse_command_line.h"
+
+using K = unsigned long;
+using V = unsigned long;
+#include "set.h"
+
+using Table = decltype(std::declval<Set<K,V>>().empty(0));
+
+// runs op on keys[start,end) with p threads, sampling latencies
+template <typename Op>
+void run_phase(const char* name, Set<K,V>& os, Table tr,
+	       parlay::sequence<K>& keys, size_t start, size_t end,
+	       int p, int sample, commandLine& P) {
+  size_t m = end - start;
+  parlay::sequence<parlay::sequence<long>> latencies(p);
+  parlay::internal::timer t;
+  Op op;
+  parlay::parallel_for(0, p, [&] (size_t i) {
+    size_t s = start + i * m / p;
+    size_t e = start + (i + 1) * m / p;
+    auto& lat = latencies[i];
+    for (size_t j = s; j < e; j++) {
+      if (j % sample == 0) {
+	auto t0 = std::chrono::steady_clock::now();
+	op(os, tr, keys[j]);
+	auto t1 = std::chrono::steady_clock::now();
+	lat.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+      } else op(os, tr, keys[j]);
+    }
+  }, 1);
+  double duration = t.stop();
+  auto all = parlay::sort(parlay::flatten(latencies));
+  auto percentile = [&] (double q) {
+    if (all.size() == 0) return 0l;
+    return all[std::min(all.size() - 1, (size_t) (q * all.size()))];};
+  std::cout << std::setprecision(4)
+	    << P.commandName() << ","
+	    << name << ","
+	    << "keys=" << m << ","
+	    << "p=" << p << ","
+	    << "buckets=" << os.size(tr) << ","
+	    << "p50=" << percentile(.5) << ","
+	    << "p99=" << percentile(.99) << ","
+	    << "max=" << (all.size() == 0 ? 0 : all[all.size()-1]) << ","
+	    << m / (duration * 1e6) << std::endl;
+}
+
+struct insert_op {
+  void operator()(Set<K,V>& os, Table tr, K k) { os.insert(tr, k, 123);}};
+
+struct remove_op {
+  void operator()(Set<K,V>& os, Table tr, K k) { os.remove(tr, k);}};
+
+int main(int argc, char* argv[]) {
+  commandLine P(argc,argv,"[-n <final size>] [-i <initial size>] [-p <procs>] [-sample <one in>]");
+  size_t n = P.getOptionLongValue("-n", 100000000);
+  size_t initial = P.getOptionLongValue("-i", 1000);
+  int p = P.getOptionIntValue("-p", parlay::num_workers());
+  int sample = P.getOptionIntValue("-sample", 10);
+
+  // distinct random keys
+  auto keys = parlay::tabulate(n, [] (size_t i) -> K {
+      return parlay::hash64(i);});
+
+  Set<K,V> os;
+  Table tr = os.empty(initial);
+
+  // phases [0,initial), [initial, 10*initial), ...
+  parlay::sequence<size_t> bounds = {0};
+  for (size_t b = initial; b < n; b *= 10) bounds.push_back(b);
+  bounds.push_back(n);
+
+  for (size_t i = 0; i + 1 < bounds.size(); i++)
+    run_phase<insert_op>("insert", os, tr, keys, bounds[i], bounds[i+1],
+			 p, sample, P);
+  size_t found = os.check(tr);
+  if (found != n)
+    std::cout << "incorrect size after grow: expected " << n
+	      << " found " << found << std::endl;
+
+  for (size_t i = bounds.size() - 1; i > 0; i--)
+    run_phase<remove_op>("remove", os, tr, keys, bounds[i-1], bounds[i],
+			 p, sample, P);
+  found = os.check(tr);
+  if (found != 0)
+    std::cout << "incorrect size after shrink: found " << found << std::endl;
+
+  os.retire(tr);
+  os.clear();
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <chrono>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+// Per-thread latency histograms for the timed benchmarks.  Latencies
+// are measured in cycles with rdtsc (or in nanoseconds from a steady
+// clock on other architectures) and kept in log-linear buckets as in
+// HDR histograms: values are exact below 64, and above that each
+// power of two is split into 32 buckets, so percentiles are within
+// about 3%.  Adding a sample is an increment, and histograms from
+// different threads are merged at the end.
+
+inline unsigned long read_cycles() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	   std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// measured once against the steady clock
+inline double cycles_per_ns() {
+#if defined(__x86_64__)
+  static double r = [] {
+    auto t0 = std::chrono::steady_clock::now();
+    unsigned long c0 = read_cycles();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    unsigned long c1 = read_cycles();
+    auto t1 = std::chrono::steady_clock::now();
+    return (c1 - c0) / (double) std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+  } ();
+  return r;
+#else
+  return 1.0;
+#endif
+}
+
+struct latency_histogram {
+  static constexpr int sub_bits = 5;
+  static constexpr int sub_count = 1 << sub_bits;
+  static constexpr int num_buckets = (64 - sub_bits + 1) * sub_count;
+
+  std::vector<size_t> counts;
+  size_t total;
+  latency_histogram() : counts(num_buckets, 0), total(0) {}
+
+  static int bucket(unsigned long v) {
+    if (v < 2 * sub_count) return v;
+    int shift = 63 - __builtin_clzl(v) - sub_bits;
+    return (shift + 1) * sub_count + (int) (v >> shift) - sub_count;
+  }
+
+  // the smallest value in bucket b
+  static unsigned long value(int b) {
+    if (b < 2 * sub_count) return b;
+    int shift = b / sub_count - 1;
+    return ((unsigned long) (b % sub_count + sub_count)) << shift;
+  }
+
+  void add(unsigned long v) { counts[bucket(v)]++; total++; }
+
+  void merge(const latency_histogram& h) {
+    for (int i = 0; i < num_buckets; i++) counts[i] += h.counts[i];
+    total += h.total;
+  }
+
+  // the value at quantile q, e.g. .99
+  unsigned long percentile(double q) {
+    size_t rank = (size_t) (q * total);
+    size_t sum = 0;
+    for (int i = 0; i < num_buckets; i++) {
+      sum += counts[i];
+      if (sum > rank) return value(i);
+    }
+    return value(num_buckets - 1);
+  }
+};
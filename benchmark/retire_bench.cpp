@@ -0,0 +1,60 @@
+// Measures the throughput of retire as the number of threads grows.
+// Each thread repeatedly allocates an object and retires it inside of
+// with_epoch, which periodically advances the epoch.  Reports millions
+// of retires per second and the number of epochs advanced.
+
+#include <iostream>
+#include <iomanip>
+#include <parlay/primitives.h>
+#include <parlay/internal/get_time.h>
+#include <flock/flock.h>
+#include "parse_command_line.h"
+
+struct alignas(32) object {
+  long vals[4];
+  object(long v) { vals[0] = v;}
+};
+
+flck::memory_pool<object> object_pool;
+
+int main(int argc, char* argv[]) {
+  commandLine P(argc,argv,"[-tt <trial time>] [-r <rounds>] [-p <max procs>]");
+  int max_p = P.getOptionIntValue("-p", parlay::num_workers());
+  int rounds = P.getOptionIntValue("-r", 1);
+  double trial_time = P.getOptionDoubleValue("-tt", 1.0);
+
+  for (int r = 0; r < rounds; r++) {
+    for (int p = 1; ; p = std::min(2*p, max_p)) {
+      parlay::sequence<size_t> totals(p);
+      long start_epoch = flck::internal::epoch.get_current();
+      parlay::internal::timer t;
+      auto start = std::chrono::system_clock::now();
+      parlay::parallel_for(0, p, [&] (size_t i) {
+	size_t total = 0;
+	while (true) {
+	  // every once in a while check if time is over
+	  if (total % 100 == 0) {
+	    auto current = std::chrono::system_clock::now();
+	    double duration = std::chrono::duration_cast<std::chrono::milliseconds>(current - start).count();
+	    if (duration > 1000*trial_time) {
+	      totals[i] = total;
+	      return;
+	    }
+	  }
+	  flck::with_epoch([&] {
+	    object_pool.retire(object_pool.new_obj(total));});
+	  total++;
+	}
+      }, 1);
+      double duration = t.stop();
+      long epochs = flck::internal::epoch.get_current() - start_epoch;
+      std::cout << std::setprecision(4)
+		<< P.commandName() << ","
+		<< "p=" << p << ","
+		<< "epochs=" << epochs << ","
+		<< parlay::reduce(totals) / (duration * 1e6) << std::endl;
+      if (p == max_p) break;
+    }
+  }
+  object_pool.clear();
+}
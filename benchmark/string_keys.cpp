@@ -0,0 +1,145 @@
+// Times a set with std::string keys on n generated email-like keys
+// (e.g. "maria.lopez1234@mail.example.org"), which share long common
+// prefixes.  With p threads it inserts the keys, finds them all, finds
+// as many absent keys, runs prefix range queries (all keys starting
+// with a first name and initial, e.g. "maria.l") if the set supports
+// range searches, and removes the keys again.  For each phase it
+// reports the throughput in millions of operations per second.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <atomic>
+#include <parlay/primitives.h>
+#include <parlay/internal/get_time.h>
+#include <flock/flock.h>
+#include "parse_command_line.h"
+
+using K = std::string;
+using V = unsigned long;
+#include "set.h"
+
+using Table = decltype(std::declval<Set<K,V>>().empty(0));
+
+const char* first_names[] = {
+  "james", "mary", "robert", "patricia", "john", "jennifer", "michael",
+  "linda", "david", "elizabeth", "william", "barbara", "richard", "susan",
+  "joseph", "jessica", "thomas", "sarah", "charles", "karen", "wei",
+  "maria", "jose", "ana", "juan", "fatima", "mohammed", "olga", "yuki",
+  "priya", "amit", "chen"};
+
+const char* last_names[] = {
+  "smith", "johnson", "williams", "brown", "jones", "garcia", "miller",
+  "davis", "rodriguez", "martinez", "hernandez", "lopez", "gonzalez",
+  "wilson", "anderson", "thomas", "taylor", "moore", "jackson", "martin",
+  "lee", "perez", "thompson", "white", "harris", "sanchez", "clark",
+  "ramirez", "lewis", "robinson", "walker", "young", "wang", "li",
+  "zhang", "kumar", "singh", "ivanova", "tanaka", "kim"};
+
+const char* domains[] = {
+  "gmail.com", "yahoo.com", "hotmail.com", "outlook.com", "cs.cmu.edu",
+  "mail.example.org", "corp.example.com", "university.edu"};
+
+template <typename T, size_t N>
+constexpr size_t count(T (&)[N]) { return N; }
+
+// the i-th email-like key, round is used to generate keys disjoint
+// from those of round 0 (the numbers are then at least 10^6)
+K email(size_t i, int round = 0) {
+  size_t h = parlay::hash64(i);
+  std::string s = first_names[h % count(first_names)];
+  s += (h >> 8) & 1 ? "." : "_";
+  s += last_names[(h >> 16) % count(last_names)];
+  s += std::to_string(round * 1000000 + (h >> 24) % 1000000);
+  s += "@";
+  s += domains[(h >> 48) % count(domains)];
+  return s;
+}
+
+template <typename F>
+void run_phase(const char* name, size_t m, F f, commandLine& P) {
+  parlay::internal::timer t;
+  f();
+  double duration = t.stop();
+  std::cout << std::setprecision(4)
+	    << P.commandName() << ","
+	    << name << ","
+	    << "ops=" << m << ","
+	    << "p=" << parlay::num_workers() << ","
+	    << m / (duration * 1e6) << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  commandLine P(argc,argv,"[-n <num keys>] [-r <num range queries>]");
+  size_t n = P.getOptionLongValue("-n", 1000000);
+  size_t nr = P.getOptionLongValue("-r", 10000);
+
+  auto keys = parlay::remove_duplicates(parlay::tabulate(n, [] (size_t i) {
+	return email(i);}));
+  keys = parlay::random_shuffle(keys);
+  n = keys.size();
+  auto absent = parlay::tabulate(n, [] (size_t i) {return email(i, 1);});
+  size_t avg_len = parlay::reduce(parlay::map(keys, [] (auto& k) {
+	return k.size();})) / n;
+  std::cout << "keys=" << n << ", average length=" << avg_len
+	    << ", example=" << keys[0] << std::endl;
+
+  Set<K,V> os;
+  Table tr = os.empty(n);
+
+  run_phase("insert", n, [&] {
+      parlay::parallel_for(0, n, [&] (size_t i) {
+	  os.insert(tr, keys[i], i);});}, P);
+  size_t found = os.check(tr);
+  if (found != n)
+    std::cout << "incorrect size after insert: expected " << n
+	      << " found " << found << std::endl;
+
+  std::atomic<size_t> hits = 0;
+  run_phase("find", n, [&] {
+      parlay::parallel_for(0, n, [&] (size_t i) {
+	  if (os.find(tr, keys[i]).has_value()) hits++;});}, P);
+  if (hits != n)
+    std::cout << "incorrect find: found " << hits << " of " << n << std::endl;
+
+  hits = 0;
+  run_phase("find_absent", n, [&] {
+      parlay::parallel_for(0, n, [&] (size_t i) {
+	  if (os.find(tr, absent[i]).has_value()) hits++;});}, P);
+  if (hits != 0)
+    std::cout << "incorrect find: found " << hits << " absent keys" << std::endl;
+
+#ifdef Range_Search
+  // prefixes such as "maria.l" or "john_s", checked against a count
+  // over the sorted keys
+  auto prefixes = parlay::tabulate(nr, [&] (size_t i) {
+      K k = email(parlay::hash64(i) % n);
+      return k.substr(0, k.find_first_of("._") + 2);});
+  std::atomic<size_t> in_range = 0;
+  run_phase("prefix_range", nr, [&] {
+      parlay::parallel_for(0, nr, [&] (size_t i) {
+	  size_t cnt = 0;
+	  auto add = [&] (const K& k, V v) {cnt++;};
+	  os.range(tr, add, prefixes[i], prefixes[i] + "\xff");
+	  in_range += cnt;});}, P);
+  auto sorted = parlay::sort(keys);
+  size_t expected = parlay::reduce(parlay::map(prefixes, [&] (const K& pre) {
+	auto lo = std::lower_bound(sorted.begin(), sorted.end(), pre);
+	auto hi = std::lower_bound(sorted.begin(), sorted.end(), pre + "\xff");
+	return (size_t) (hi - lo);}));
+  if (in_range != expected)
+    std::cout << "incorrect range: found " << in_range
+	      << " expected " << expected << std::endl;
+  std::cout << "average keys per range=" << in_range / nr << std::endl;
+#endif
+
+  run_phase("remove", n, [&] {
+      parlay::parallel_for(0, n, [&] (size_t i) {
+	  os.remove(tr, keys[i]);});}, P);
+  found = os.check(tr);
+  if (found != 0)
+    std::cout << "incorrect size after remove: found " << found << std::endl;
+
+  os.retire(tr);
+  os.clear();
+}
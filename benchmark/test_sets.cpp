@@ -8,7 +8,13 @@ using V = unsigned long;
 
 int main(int argc, char* argv[]) {
   commandLine P(argc,argv,"[-n <size>] [-r <rounds>] [-p <procs>] [-z <zipfian_param>] [-u <update percent>] [-insert_find_delete] [-no_help] [-strict_lock]");
+#ifdef SetBackoff
+  // a backoff policy other than the default (see backoff.h), for the
+  // structures that take it as their third template argument
+  Set<K,V,flck::SetBackoff> lst;
+#else
   Set<K,V> lst;
+#endif
   size_t default_size = 100000;
   test_sets(lst, default_size, P);
 }
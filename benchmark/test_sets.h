@@ -2,6 +2,7 @@
 #include <iostream>
 #include <sstream>
 #include <limits>
+#include <thread>
 
 #include <parlay/primitives.h>
 #include <parlay/random.h>
@@ -9,8 +10,32 @@
 #include <parlay/internal/get_time.h>
 #include <parlay/internal/group_by.h>
 #include "zipfian.h"
+#include "latency.h"
 #include "parse_command_line.h"
 
+// With CountAllocs, counts calls to the global operator new on each
+// thread so the timed benchmark can report heap allocations per
+// operation (-allocs).  Allocations from the parlay pools (e.g. nodes
+// and descriptors) only show up when a pool needs to grow.
+#ifdef CountAllocs
+static thread_local size_t heap_allocs = 0;
+
+void* operator new(std::size_t n) {
+  heap_allocs++;
+  void* p = malloc(n);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+// gcc flags free on memory from operator new, which is fine here
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, std::size_t) noexcept { free(p); }
+#pragma GCC diagnostic pop
+#else
+constexpr size_t heap_allocs = 0;
+#endif
+
 void assert_key_exists(bool b) {
   if(!b) {
     std::cout << "key not found" << std::endl;
@@ -33,7 +58,7 @@ void insert_balanced(SetType& os, Tree& tr, Range A) {
                  [&] {insert_balanced(os, tr, A.cut(mid+1,A.size()));});
 }
 
-enum op_type : char {Find, Insert, Remove, Range, MultiFind};
+enum op_type : char {Find, Insert, Remove, Range, MultiFind, FetchAdd};
 
 template <typename SetType>
 void test_sets(SetType& os, size_t default_size, commandLine P) {
@@ -47,12 +72,40 @@ void test_sets(SetType& os, size_t default_size, commandLine P) {
   double trial_time = P.getOptionDoubleValue("-tt", 1.0);
 
   bool balanced_tree = P.getOption("-bt");
+  // build the initial structure with one bulk build (needs Bulk_Build)
+  bool bulk_build = P.getOption("-build");
+#ifndef Bulk_Build
+  if (bulk_build) {
+    std::cout << "this structure does not support -build" << std::endl;
+    return;
+  }
+#endif
+  // insert the initial keys in (nearly) ascending order, as with
+  // time ordered ids, and report how long it took
+  bool sorted_insert = P.getOption("-sorted");
   int range_size = P.getOptionIntValue("-rs",16);
   int range_percent = P.getOptionIntValue("-range",0);
   int multifind_percent = P.getOptionIntValue("-mfind",0);
-  
+  // percent of counter increments (fetch_add of 1, needs Upsert)
+  int fetch_add_percent = P.getOptionIntValue("-fa",0);
+
+  // number of threads that only do range queries (of size -rs) while
+  // the others run the mix, scans are reported separately
+  int scan_threads = P.getOptionIntValue("-scan_threads",0);
+  if (scan_threads >= p) {
+    std::cout << "need fewer scan threads than threads" << std::endl;
+    return;
+  }
+
+#ifndef Upsert
+  if (fetch_add_percent > 0) {
+    std::cout << "fetch_add not implemented for this structure" << std::endl;
+    return;
+  }
+#endif
+
 #ifndef Range_Search
-  if (range_percent > 0) {
+  if (range_percent > 0 || scan_threads > 0) {
     std::cout << "range search not implemented for this structure" << std::endl;
     return;
   }
@@ -95,13 +148,44 @@ void test_sets(SetType& os, size_t default_size, commandLine P) {
   // use numbers from 1...2n if dense otherwise sparse numbers
   bool use_sparse = !P.getOption("-dense");
 #ifdef Dense_Keys  // for range queries on hash tables
-  if (range_percent > 0)
+  if (range_percent > 0 || scan_threads > 0)
     use_sparse = false;
 #endif
 
   // print memory usage statistics
   bool stats = P.getOption("-stats");
 
+  // print heap allocations per operation for the timed loop
+  bool count_allocs = P.getOption("-allocs");
+#ifndef CountAllocs
+  if (count_allocs) {
+    std::cout << "-allocs needs a build with CountAllocs" << std::endl;
+    count_allocs = false;
+  }
+#endif
+
+  // park one thread inside with_epoch for each timed trial and report
+  // how many retired objects are held back as a result, or with
+  // -stall_in_lock park it inside the thunk of a lock
+  bool stall_in_lock = P.getOption("-stall_in_lock");
+  bool stall = P.getOption("-stall") || stall_in_lock;
+
+  // sample the latency of one in this many finds, inserts and removes
+  // and report percentiles (in ns), 0 for none
+  int latency_sample = P.getOptionIntValue("-lat", 0);
+
+  // during timed trials the owner of one in this many locks stalls
+  // right after acquiring it, sleeping for -lock_stall_us microseconds,
+  // or yielding if 0 (needs InjectStalls)
+  long lock_stall = P.getOptionLongValue("-lock_stall", 0);
+  long lock_stall_us = P.getOptionLongValue("-lock_stall_us", 0);
+#ifndef InjectStalls
+  if (lock_stall > 0) {
+    std::cout << "compile with InjectStalls to stall in locks" << std::endl;
+    return;
+  }
+#endif
+
   // for mixed update/query, the percent that are updates
   int update_percent = P.getOptionIntValue("-u", 20); 
 
@@ -171,6 +255,9 @@ void test_sets(SetType& os, size_t default_size, commandLine P) {
         else if (h < 2*update_percent + 2*range_percent) return Range;
         else if (h < 2*update_percent + 2*range_percent + 2*multifind_percent)
           return MultiFind;
+        else if (h < 2*update_percent + 2*range_percent + 2*multifind_percent
+                 + 2*fetch_add_percent)
+          return FetchAdd;
         else return Find; });
     
     parlay::internal::timer t;
@@ -191,10 +278,28 @@ void test_sets(SetType& os, size_t default_size, commandLine P) {
       if (verbose) std::cout << "round " << i << std::endl;
       if (fixed_time) {
         size_t initial_size = n;
+        double sorted_insert_time = 0.0;
         if (balanced_tree) {
           auto x = parlay::sort(parlay::remove_duplicates(a.head(n)));
           auto y = x.head(x.size());
           insert_balanced(os, tr, y);
+#ifdef Bulk_Build
+        } else if (bulk_build) {
+          os.retire(tr);
+          parlay::internal::timer bt;
+          tr = os.build(parlay::tabulate(n, [&] (size_t i) {
+                return typename SetType::KV{a[i], 123};}));
+          if (verbose) std::cout << "build time: " << bt.stop() << std::endl;
+#endif
+        } else if (sorted_insert) {
+          // blocks of consecutive keys in order, each block in parallel
+          auto x = parlay::sort(a.head(n));
+          size_t block = 1000;
+          parlay::internal::timer st;
+          for (size_t s = 0; s < n; s += block)
+            parlay::parallel_for(s, std::min(s + block, (size_t) n), [&] (size_t i) {
+              os.insert(tr, x[i], 123); }, 1, true);
+          sorted_insert_time = st.stop();
         } else {
 
           parlay::parallel_for(0, n, [&] (size_t i) {
@@ -222,12 +327,20 @@ void test_sets(SetType& os, size_t default_size, commandLine P) {
         parlay::sequence<size_t> totals(p);
         parlay::sequence<long> addeds(p);
         parlay::sequence<long> range_counts(p);
+        parlay::sequence<long> range_query_counts(p);
         parlay::sequence<long> mfind_counts(p);
         parlay::sequence<long> retry_counts(p);
         parlay::sequence<long> update_counts(p);
         parlay::sequence<long> query_counts(p);
 	parlay::sequence<long> query_success_counts(p);
+        parlay::sequence<size_t> alloc_counts(p);
+        // for each thread, a histogram for each of Find, Insert and Remove
+        std::vector<std::vector<latency_histogram>> latencies(
+            latency_sample > 0 ? p : 0, std::vector<latency_histogram>(3));
+        long stalled_unreclaimed = 0;
+        flck::lock stall_lock;
         size_t mp = m/p;
+        flck::inject_stalls(lock_stall, lock_stall_us);
         t.start();
         auto start = std::chrono::system_clock::now();
         std::atomic<bool> finish = false;
@@ -237,11 +350,41 @@ void test_sets(SetType& os, size_t default_size, commandLine P) {
           size_t total = 0;
           long added = 0;
           long range_count = 0;
+          long range_query_count = 0;
           long mfind_count = 0;
           long retry_count = 0;
           long update_count = 0;
           long query_count = 0;
           long query_success_count = 0;
+          bool is_scanner = i < scan_threads;
+          // runs f, timing it every latency_sample operations
+          auto timed = [&] (op_type op, auto f) {
+            if (latency_sample == 0 || j % latency_sample != 0) return f();
+            unsigned long t0 = read_cycles();
+            auto r = f();
+            latencies[i][op].add(read_cycles() - t0);
+            return r;};
+          std::vector<key_type> range_keys;
+          range_keys.reserve(100 + 2*range_size);
+          std::vector<key_type> mfind_keys;
+          mfind_keys.reserve(range_size);
+          std::vector<decltype(os.find_(tr, key_type()))> mfind_results(range_size);
+          size_t allocs_start = heap_allocs;
+          if (stall && p > 1 && i == p-1) { // stalls holding its epoch
+            auto park = [&] {
+              while (!finish) {
+                auto current = std::chrono::system_clock::now();
+                double duration = std::chrono::duration_cast<std::chrono::milliseconds>(current - start).count();
+                if (duration > 1000*trial_time) break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+              }
+              stalled_unreclaimed = flck::internal::unreclaimed();};
+            flck::with_epoch([&] {
+              if (stall_in_lock)
+                stall_lock.with_lock([&] {park(); return true;});
+              else park();});
+            return;
+          }
           while (true) {
             // every once in a while check if time is over
             if (cnt >= 100) { 
@@ -252,60 +395,85 @@ void test_sets(SetType& os, size_t default_size, commandLine P) {
                 totals[i] = total;
                 addeds[i] = added;
                 range_counts[i] = range_count;
+                range_query_counts[i] = range_query_count;
                 mfind_counts[i] = mfind_count;
                 retry_counts[i] = retry_count;
                 update_counts[i] = update_count;
                 query_counts[i] = query_count;
 		query_success_counts[i] = query_success_count;
+                alloc_counts[i] = heap_allocs - allocs_start;
                 return;
               }
             }
             // check that no overflow
             if (j >= (i+1)*mp) abort();
          
-            if (op_types[j] == Find) {
+            op_type op = is_scanner ? Range : op_types[j];
+            if (op == Find) {
               query_count++;
-	      query_success_count += os.find(tr, b[j]).has_value();
+	      query_success_count += timed(Find, [&] {
+                  return os.find(tr, b[j]).has_value();});
             }
-            else if (op_types[j] == Insert) {
+            else if (op == Insert) {
               update_count++;
-              if (os.insert(tr, b[j], 123)) added++;}
-            else if (op_types[j] == Remove) {
+              if (timed(Insert, [&] {return os.insert(tr, b[j], 123);}))
+                added++;}
+            else if (op == Remove) {
               update_count++;
-              if (os.remove(tr, b[j])) added--;}
-//             else if (op_types[j] == Range) {
-// #ifdef Range_Search
-// 	      std::vector<K> range_keys{100ul + 2*range_size};
-//               key_type end = ((b[j] > max_key - range_gap)
-//                              ? max_key : b[j] + range_gap);
-// 	      long cnt=0;
-// 	      auto addf = [&] (K k, V v) {range_keys[cnt++] = k;};
-// 	      os.range_(tr, addf, b[j], end);
-//               range_count += cnt;
-// #endif
-//             } else { // multifind
-//               mfind_count++;
-// 	      long tmp_sum = 0;
-// 	      long loc = j;
-// 	      for (long k = 0; k < range_size; k++) {
-// 		auto val = os.find_(tr, b[loc]);
-// 		loc += 1;
-// 		if (loc >= (i+1)*mp) loc -= mp;
-// 		if(val.has_value()) tmp_sum += val.value();
-// 	      }
-//               keysum += tmp_sum;
-//               j += range_size;
-//               if (j >= (i+1)*mp) j -= mp;
-//               cnt += range_size;
-//               total += range_size;
-//               continue;
-//             }
+              if (timed(Remove, [&] {return os.remove(tr, b[j]);}))
+                added--;}
+            else if (op == FetchAdd) {
+#ifdef Upsert
+              update_count++;
+              // all values are positive, so 0 means it was inserted
+              if (os.fetch_add(tr, b[j], 1) == 0) added++;
+#endif
+            }
+            else if (op == Range) {
+#ifdef Range_Search
+              range_query_count++;
+              key_type end = ((b[j] > max_key - range_gap)
+                             ? max_key : b[j] + range_gap);
+              range_keys.clear();
+              auto addf = [&] (key_type k, auto v) {range_keys.push_back(k);};
+              flck::with_snap([&] {os.range_(tr, addf, b[j], end);});
+              range_count += range_keys.size();
+#endif
+            } else { // multifind: range_size finds in a single epoch
+              mfind_count++;
+              size_t loc = j;
+              query_count += range_size;
+#ifdef Multi_Find  // interleaved by the structure
+              mfind_keys.clear();
+              for (long k = 0; k < range_size; k++) {
+                mfind_keys.push_back(b[loc]);
+                if (++loc >= (i+1)*mp) loc -= mp;
+              }
+              os.multi_find(tr, mfind_keys.data(), mfind_results.data(),
+                            range_size);
+              for (long k = 0; k < range_size; k++)
+                query_success_count += mfind_results[k].has_value();
+#else
+              query_success_count += flck::with_epoch([&] {
+                long found = 0;
+                for (long k = 0; k < range_size; k++) {
+                  found += os.find_(tr, b[loc]).has_value();
+                  if (++loc >= (i+1)*mp) loc -= mp;
+                }
+                return found;});
+#endif
+              j = loc;
+              cnt += range_size;
+              total += range_size;
+              continue;
+            }
             if (++j >= (i+1)*mp) j -= mp;
             cnt++;
             total++;
           }
         }, 1);
         double duration = t.stop();
+        flck::inject_stalls(0);
 
         if (i != 0) { // don't report zeroth round -- warmup
           if (finish && (duration < trial_time/4))
@@ -313,7 +481,8 @@ void test_sets(SetType& os, size_t default_size, commandLine P) {
                 << duration << " seconds" << std::endl;
 
           //std::cout << duration << " : " << trial_time << std::endl;
-          size_t num_ops = parlay::reduce(totals);
+          // scan threads are reported separately
+          size_t num_ops = parlay::reduce(totals.cut(scan_threads, p));
           std::cout << std::setprecision(4)
               << P.commandName() << ","
               << update_percent << "%update,"
@@ -322,8 +491,60 @@ void test_sets(SetType& os, size_t default_size, commandLine P) {
               << "rs=" << range_size << ","
               << "n=" << n << ","
               << "p=" << p << ","
-              << "z=" << zipfian_param << ","
-              << num_ops / (duration * 1e6) << std::endl;
+              << "z=" << zipfian_param << ",";
+          if (scan_threads > 0) std::cout << "st=" << scan_threads << ",";
+          if (fetch_add_percent > 0)
+            std::cout << fetch_add_percent << "%fadd,";
+          if (sorted_insert)
+            std::cout << "sorted_insert=" << sorted_insert_time << "s,";
+          if (lock_stall > 0)
+            std::cout << "lock_stall=" << lock_stall << "/" << lock_stall_us << "us,";
+          if (latency_sample > 0) {
+            const char* names[] = {"find", "insert", "remove"};
+            for (int op = Find; op <= Remove; op++) {
+              latency_histogram h;
+              for (auto& l : latencies) h.merge(l[op]);
+              if (h.total == 0) continue;
+              auto ns = [&] (double q) {
+                return (long) (h.percentile(q) / cycles_per_ns());};
+              std::cout << names[op] << "_p50=" << ns(.5) << ","
+                        << names[op] << "_p99=" << ns(.99) << ","
+                        << names[op] << "_p999=" << ns(.999) << ",";
+            }
+          }
+          std::cout << num_ops / (duration * 1e6) << std::endl;
+          if (range_percent > 0 || scan_threads > 0) {
+            auto report = [&] (const char* who, size_t s, size_t e) {
+              long queries = parlay::reduce(range_query_counts.cut(s, e));
+              long keys = parlay::reduce(range_counts.cut(s, e));
+              std::cout << who << " range queries per second = "
+                        << queries / duration
+                        << ", keys per second = " << keys / duration
+                        << ", average range size = "
+                        << (queries > 0 ? ((double) keys) / queries : 0.0)
+                        << std::endl;};
+            if (scan_threads > 0) report("scan threads:", 0, scan_threads);
+            if (range_percent > 0) report("mix threads:", scan_threads, p);
+          }
+          if (count_allocs)
+            std::cout << "heap allocations per operation = "
+                      << ((double) parlay::reduce(alloc_counts)) / num_ops
+                      << std::endl;
+          if (stall && p > 1) {
+            std::cout << "unreclaimed objects with stalled thread = "
+                      << stalled_unreclaimed << std::endl;
+#ifdef IBR
+            // With IBR the stalled thread only holds back objects live
+            // when it stalled (a small constant per key) plus per-thread
+            // slack for the era granularity and the unscanned retire bags.
+            long bound = 4 * n + 8 * p * (p + 64);
+            if (stalled_unreclaimed > bound) {
+              std::cout << "unreclaimed objects exceed bound of " << bound
+                        << std::endl;
+              abort();
+            }
+#endif
+          }
           if (do_check) {
 	    size_t queries = parlay::reduce(query_counts);
 	    size_t queries_success = parlay::reduce(query_success_counts);
@@ -336,13 +557,6 @@ void test_sets(SetType& os, size_t default_size, commandLine P) {
               long mfind_sum = parlay::reduce(mfind_counts);
               long retry_sum = parlay::reduce(retry_counts);
             }
-            if (range_percent > 0) {
-              long range_sum = parlay::reduce(range_counts);
-              long retry_sum = parlay::reduce(retry_counts);
-              long num_queries = num_ops * range_percent / 100;
-              std::cout << "average range size = " << ((float) range_sum) / num_queries
-			<< std::endl;
-            }
 
             if (initial_size + updates != final_cnt) {
               std::cout << "bad size: intial size = " << initial_size 
@@ -437,4 +651,10 @@ void test_sets(SetType& os, size_t default_size, commandLine P) {
       }
     }
   }
+#if defined(LogStats) && !defined(NoHelp)
+  flck::internal::print_log_stats();
+#endif
+#ifdef BackoffStats
+  flck::print_backoff_stats();
+#endif
 }
@@ -0,0 +1,98 @@
+// Compares validated (optimistic) reads to exclusive locking on a read
+// heavy workload.  Each record holds two counters whose sum is fixed.
+// A writer moves one unit from one counter to the other under the
+// record's lock, and a reader reads both and checks the sum.  Readers
+// use with_validated_read, or with_lock if run with -exclusive.  A
+// validated read can see a partial update, but must never return one.
+// Reports millions of operations per second for each.
+
+#include <iostream>
+#include <iomanip>
+#include <parlay/primitives.h>
+#include <parlay/internal/get_time.h>
+#include <flock/flock.h>
+#include "zipfian.h"
+#include "parse_command_line.h"
+
+constexpr int total = 1000;
+
+struct alignas(64) record : flck::lock {
+  flck::atomic<int> a;
+  flck::atomic<int> b;
+  record() : a(total), b(0) {}
+};
+
+int main(int argc, char* argv[]) {
+  commandLine P(argc,argv,"[-n <records>] [-u <update percent>] [-z <zipfian param>] [-tt <trial time>] [-r <rounds>] [-p <procs>] [-exclusive]");
+  long n = P.getOptionIntValue("-n", 1000);
+  int update_percent = P.getOptionIntValue("-u", 5);
+  double zipfian_param = P.getOptionDoubleValue("-z", 0.0);
+  double trial_time = P.getOptionDoubleValue("-tt", 1.0);
+  int rounds = P.getOptionIntValue("-r", 1);
+  int p = P.getOptionIntValue("-p", parlay::num_workers());
+  bool exclusive_only = P.getOption("-exclusive");
+
+  parlay::sequence<record> records(n);
+  long m = 10000000;
+  parlay::sequence<long> idx;
+  if (zipfian_param != 0.0) {
+    Zipfian z(n, zipfian_param);
+    idx = parlay::tabulate(m, [&] (long i) {return (long) z(i);});
+  } else
+    idx = parlay::tabulate(m, [&] (long i) {return (long) (parlay::hash64(i) % n);});
+
+  for (int r = 0; r < rounds; r++) {
+    for (bool exclusive : {true, false}) {
+      if (exclusive_only && !exclusive) continue;
+      parlay::sequence<size_t> totals(p);
+      std::atomic<long> bad = 0;
+      parlay::internal::timer t;
+      auto start = std::chrono::system_clock::now();
+      parlay::parallel_for(0, p, [&] (size_t i) {
+	size_t cnt = 0;
+	long j = parlay::hash64(i) % m;
+	while (true) {
+	  // every once in a while check if time is over
+	  if (cnt % 100 == 0) {
+	    auto current = std::chrono::system_clock::now();
+	    double duration = std::chrono::duration_cast<std::chrono::milliseconds>(current - start).count();
+	    if (duration > 1000*trial_time) {
+	      totals[i] = cnt;
+	      return;
+	    }
+	  }
+	  record* x = &records[idx[j]];
+	  bool update = (parlay::hash64(m + i*m + cnt) % 100) < (size_t) update_percent;
+	  flck::with_epoch([&] {
+	    if (update)
+	      x->with_lock([=] {
+		  int a = x->a.load();
+		  int b = x->b.load();
+		  if (a > 0) {x->a = a-1; x->b = b+1;}
+		  else {x->a = b; x->b = 0;}
+		  return true;});
+	    else {
+	      auto read = [=] {return x->a.load() + x->b.load();};
+	      int sum = exclusive ? x->with_lock(read) : x->with_validated_read(read);
+	      if (sum != total) bad++;
+	    }});
+	  if (++j == m) j = 0;
+	  cnt++;
+	}
+      }, 1);
+      double duration = t.stop();
+      if (bad > 0) {
+	std::cout << bad << " reads saw a partial update" << std::endl;
+	abort();
+      }
+      std::cout << std::setprecision(4)
+		<< P.commandName() << ","
+		<< (exclusive ? "exclusive," : "validated,")
+		<< update_percent << "%update,"
+		<< "n=" << n << ","
+		<< "p=" << p << ","
+		<< "z=" << zipfian_param << ","
+		<< parlay::reduce(totals) / (duration * 1e6) << std::endl;
+    }
+  }
+}
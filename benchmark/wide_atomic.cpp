@@ -0,0 +1,171 @@
+// Compares 8 byte values stored directly in a flck::atomic (using a
+// 16 byte CAS) to the alternative of boxing them in a separately
+// allocated object that is replaced on every update.  Each record
+// holds a counter that is incremented under the record's lock, and
+// read without one.  Reports millions of operations per second for
+// each, and checks the final counts.  A third kind of record
+// increments its counter in a lock nested in the record's lock, which
+// returns a 16 byte struct, and checks the struct, so it also tests
+// passing large results to helpers.  A fourth keeps its counter as a
+// negative double, and its negation as a long, so every value needs
+// all 8 bytes.
+
+#include <iostream>
+#include <iomanip>
+#include <parlay/primitives.h>
+#include <parlay/internal/get_time.h>
+#include <flock/flock.h>
+#include "zipfian.h"
+#include "parse_command_line.h"
+
+struct alignas(64) wide_record : flck::lock {
+  flck::atomic<long> count;
+  wide_record() : count(0) {}
+  void increment() {
+    with_lock([=] {count = count.load() + 1; return true;});}
+  long get() {return count.read();}
+};
+
+struct box {
+  long count;
+  box(long count) : count(count) {}
+};
+
+flck::memory_pool<box> box_pool;
+
+struct alignas(64) boxed_record : flck::lock {
+  flck::atomic<box*> b;
+  boxed_record() : b(box_pool.new_obj(0)) {}
+  void increment() {
+    with_lock([=] {
+	box* old = b.load();
+	b = box_pool.new_obj(old->count + 1);
+	box_pool.retire(old);
+	return true;});}
+  long get() {return b.read()->count;}
+};
+
+struct alignas(64) nested_record : flck::lock {
+  struct state {long count; long twice;};
+  flck::lock inner;
+  flck::atomic<long> count;
+  flck::atomic<long> twice; // always twice count
+  nested_record() : count(0), twice(0) {}
+  void increment() {
+    bool ok = with_lock([=] {
+      state s = inner.with_lock([=] {
+	  long c = count.load();
+	  long t = twice.load();
+	  count = c + 1;
+	  twice = t + 2;
+	  return state{c + 1, t + 2};});
+      auto r = inner.try_lock_result([=] {
+	  return state{count.load(), twice.load()};});
+      return (s.twice == 2 * s.count &&
+	      (!r.has_value() || (r->count == s.count && r->twice == s.twice)));});
+    if (!ok) {
+      std::cout << "nested: inconsistent result" << std::endl;
+      abort();
+    }
+  }
+  long get() {return count.read();}
+};
+
+struct alignas(64) signed_record : flck::lock {
+  static constexpr double base = -1e15;
+  flck::atomic<double> value; // base + count
+  flck::atomic<long> negated; // always -count
+  signed_record() : value(base), negated(0) {}
+  void increment() {
+    bool ok = with_lock([=] {
+      double v = value.load();
+      long c = negated.load();
+      value = v + 1.0;
+      negated = c - 1;
+      return (long) (v - base) == -c;});
+    if (!ok) {
+      std::cout << "signed: inconsistent values" << std::endl;
+      abort();
+    }
+  }
+  long get() {return (long) (value.read() - base);}
+};
+
+template <typename Record>
+void run(commandLine& P, std::string name, parlay::sequence<long>& idx,
+	 long n, int update_percent, int p, double trial_time) {
+  long m = idx.size();
+  parlay::sequence<Record> records(n);
+  parlay::sequence<size_t> totals(p);
+  parlay::sequence<long> updates(p);
+  std::atomic<long> dummy = 0;
+  parlay::internal::timer t;
+  auto start = std::chrono::system_clock::now();
+  parlay::parallel_for(0, p, [&] (size_t i) {
+    size_t cnt = 0;
+    long updated = 0;
+    long sum = 0;
+    long j = parlay::hash64(i) % m;
+    while (true) {
+      // every once in a while check if time is over
+      if (cnt % 100 == 0) {
+	auto current = std::chrono::system_clock::now();
+	double duration = std::chrono::duration_cast<std::chrono::milliseconds>(current - start).count();
+	if (duration > 1000*trial_time) {
+	  totals[i] = cnt;
+	  updates[i] = updated;
+	  dummy += sum;
+	  return;
+	}
+      }
+      Record* x = &records[idx[j]];
+      bool update = (parlay::hash64(m + i*m + cnt) % 100) < (size_t) update_percent;
+      flck::with_epoch([&] {
+	if (update) {x->increment(); updated++;}
+	else sum += x->get();});
+      if (++j == m) j = 0;
+      cnt++;
+    }
+  }, 1);
+  double duration = t.stop();
+  long total_count = flck::with_epoch([&] {
+      return parlay::reduce(parlay::tabulate(n, [&] (long i) {
+	    return records[i].get();}));});
+  if (total_count != parlay::reduce(updates)) {
+    std::cout << name << ": expected total count " << parlay::reduce(updates)
+	      << ", found " << total_count << std::endl;
+    abort();
+  }
+  std::cout << std::setprecision(4)
+	    << P.commandName() << ","
+	    << name << ","
+	    << update_percent << "%update,"
+	    << "n=" << n << ","
+	    << "p=" << p << ","
+	    << parlay::reduce(totals) / (duration * 1e6) << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  commandLine P(argc,argv,"[-n <records>] [-u <update percent>] [-z <zipfian param>] [-tt <trial time>] [-r <rounds>] [-p <procs>]");
+  long n = P.getOptionIntValue("-n", 100000);
+  int update_percent = P.getOptionIntValue("-u", 50);
+  double zipfian_param = P.getOptionDoubleValue("-z", 0.0);
+  double trial_time = P.getOptionDoubleValue("-tt", 1.0);
+  int rounds = P.getOptionIntValue("-r", 1);
+  int p = P.getOptionIntValue("-p", parlay::num_workers());
+
+  long m = 10000000;
+  parlay::sequence<long> idx;
+  if (zipfian_param != 0.0) {
+    Zipfian z(n, zipfian_param);
+    idx = parlay::tabulate(m, [&] (long i) {return (long) z(i);});
+  } else
+    idx = parlay::tabulate(m, [&] (long i) {return (long) (parlay::hash64(i) % n);});
+
+  for (int r = 0; r < rounds; r++) {
+    run<wide_record>(P, "wide", idx, n, update_percent, p, trial_time);
+    run<boxed_record>(P, "boxed", idx, n, update_percent, p, trial_time);
+    run<nested_record>(P, "nested", idx, n, update_percent, p, trial_time);
+    run<signed_record>(P, "signed", idx, n, update_percent, p, trial_time);
+  }
+}
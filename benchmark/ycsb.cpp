@@ -0,0 +1,252 @@
+// Runs the YCSB core workloads on a set, one after the other:
+//   A: 50% reads, 50% updates
+//   B: 95% reads, 5% updates
+//   C: 100% reads
+//   D: 95% reads, 5% inserts, reads skewed towards the latest inserts
+//   E: 95% short scans, 5% inserts
+//   F: 50% reads, 50% read-modify-writes
+// Reads, updates and scan starts are drawn from a scrambled Zipfian
+// distribution over the records.  For each workload it loads n
+// records into an empty set, runs the mix with p threads for a fixed
+// time, and reports the throughput, the fraction of reads that found
+// their key and, with -lat, latency percentiles in nanoseconds.
+// Scans need Range_Search and are skipped for other sets.
+//
+// Sets that define Upsert update a value with upsert, and do a
+// read-modify-write with update.  For the others an update is a remove
+// followed by an insert of the key with a new value.
+
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <parlay/primitives.h>
+#include <parlay/internal/get_time.h>
+#include <flock/flock.h>
+#include "parse_command_line.h"
+#include "zipfian.h"
+#include "latency.h"
+
+using K = unsigned long;
+using V = unsigned long;
+#include "set.h"
+
+using Table = decltype(std::declval<Set<K,V>>().empty(0));
+
+enum ycsb_op {Read, Update, Insert, Scan, ReadModifyWrite};
+const char* op_names[] = {"read", "update", "insert", "scan", "rmw"};
+
+struct workload {
+  char name;
+  int read, update, insert, scan, rmw; // percents
+  bool latest;  // reads are skewed to the latest inserts
+};
+
+workload workloads[] = {
+  {'A', 50, 50, 0, 0, 0, false},
+  {'B', 95, 5, 0, 0, 0, false},
+  {'C', 100, 0, 0, 0, 0, false},
+  {'D', 95, 0, 5, 0, 0, true},
+  {'E', 0, 0, 5, 95, 0, false},
+  {'F', 50, 0, 0, 0, 50, false}};
+
+// The key of the i-th record.  Keys are hashed, as in YCSB, so that
+// inserts are not in key order, except for sets that need dense keys
+// for their range searches.  Zero is avoided.
+K key_of(size_t i) {
+#ifdef Dense_Keys
+  return i + 1;
+#else
+  return (parlay::hash64(i) >> 1) + 1;
+#endif
+}
+
+// expected distance between consecutive keys of n records
+K key_gap(size_t n) {
+#ifdef Dense_Keys
+  return 1;
+#else
+  return (~0ul >> 1) / n;
+#endif
+}
+
+void run_workload(workload& w, Set<K,V>& os, size_t n, int p,
+		  double trial_time, double zipfian_param, int max_scan,
+		  int latency_sample, int round, commandLine& P) {
+#ifndef Range_Search
+  if (w.scan > 0) {
+    std::cout << "workload " << w.name
+	      << " skipped: set does not support range searches" << std::endl;
+    return;
+  }
+#endif
+  // sampled records and ops for each thread, reused if it runs out
+  size_t m = (size_t) (trial_time * 2000000 * std::min(p, 100));
+  size_t mp = m / p;
+  parlay::sequence<size_t> records;
+  if (w.latest) { // relative to the last of the initial records
+    Latest z(n, zipfian_param);
+    records = parlay::tabulate(m, [&] (size_t i) { return z(i, n-1);});
+  } else {
+    ScrambledZipfian z(n, zipfian_param);
+    records = parlay::tabulate(m, [&] (size_t i) { return z(i);});
+  }
+  auto ops = parlay::tabulate(m, [&] (size_t i) -> ycsb_op {
+      int h = parlay::hash64(m+i) % 100;
+      if ((h -= w.read) < 0) return Read;
+      if ((h -= w.update) < 0) return Update;
+      if ((h -= w.insert) < 0) return Insert;
+      if ((h -= w.scan) < 0) return Scan;
+      return ReadModifyWrite;});
+
+  Table tr = os.empty(n);
+  parlay::parallel_for(0, n, [&] (size_t i) {
+    os.insert(tr, key_of(i), i);}, 10, true);
+  std::atomic<size_t> next_record = n;
+
+  parlay::sequence<size_t> totals(p);
+  parlay::sequence<long> read_counts(p);
+  parlay::sequence<long> found_counts(p);
+  parlay::sequence<long> scan_counts(p);
+  parlay::sequence<long> scanned_counts(p);
+  std::vector<std::vector<latency_histogram>> latencies(
+      latency_sample > 0 ? p : 0, std::vector<latency_histogram>(5));
+
+  auto update = [&] (K k, V v) {
+#ifdef Upsert
+    os.upsert(tr, k, v);
+#else
+    os.remove(tr, k);
+    os.insert(tr, k, v);
+#endif
+    return true;};
+
+  parlay::internal::timer t;
+  auto start = std::chrono::system_clock::now();
+  parlay::parallel_for(0, p, [&] (size_t i) {
+    int cnt = 0;
+    size_t j = i*mp;
+    size_t total = 0;
+    long read_count = 0;
+    long found_count = 0;
+    long scan_count = 0;
+    long scanned_count = 0;
+    // runs f, timing it every latency_sample operations
+    auto timed = [&] (ycsb_op op, auto f) {
+      if (latency_sample == 0 || j % latency_sample != 0) return f();
+      unsigned long t0 = read_cycles();
+      auto r = f();
+      latencies[i][op].add(read_cycles() - t0);
+      return r;};
+    while (true) {
+      // every once in a while check if time is over
+      if (cnt >= 100) {
+	cnt = 0;
+	auto current = std::chrono::system_clock::now();
+	double duration = std::chrono::duration_cast<std::chrono::milliseconds>(current - start).count();
+	if (duration > 1000*trial_time) {
+	  totals[i] = total;
+	  read_counts[i] = read_count;
+	  found_counts[i] = found_count;
+	  scan_counts[i] = scan_count;
+	  scanned_counts[i] = scanned_count;
+	  return;
+	}
+      }
+      size_t r = records[j];
+      if (w.latest) r += next_record.load() - n;
+      K k = key_of(r);
+      ycsb_op op = ops[j];
+      if (op == Read) {
+	read_count++;
+	found_count += timed(Read, [&] {return os.find(tr, k).has_value();});
+      } else if (op == Update) {
+	timed(Update, [&] {return update(k, j);});
+      } else if (op == Insert) {
+	timed(Insert, [&] {return os.insert(tr, key_of(next_record++), j);});
+      } else if (op == Scan) {
+#ifdef Range_Search
+	scan_count++;
+	K len = 1 + parlay::hash64(j) % max_scan;
+	// inserts make keys denser, so the gap is for the current count
+	K gap = key_gap(next_record.load());
+	K end = (k > ~0ul - len*gap) ? ~0ul : k + len*gap - 1;
+	long scanned = 0;
+	auto addf = [&] (K key, V v) {scanned++;};
+	timed(Scan, [&] {
+	    flck::with_snap([&] {os.range_(tr, addf, k, end);});
+	    return true;});
+	scanned_count += scanned;
+#endif
+      } else { // read-modify-write
+	read_count++;
+	found_count += timed(ReadModifyWrite, [&] {
+#ifdef Upsert
+	    return os.update(tr, k, [] (V v) {return v + 1;}).has_value();
+#else
+	    auto v = os.find(tr, k);
+	    if (v.has_value()) update(k, *v + 1);
+	    return v.has_value();
+#endif
+	  });
+      }
+      if (++j >= (i+1)*mp) j -= mp;
+      cnt++;
+      total++;
+    }
+  }, 1);
+  double duration = t.stop();
+
+  size_t num_ops = parlay::reduce(totals);
+  long reads = parlay::reduce(read_counts);
+  long scans = parlay::reduce(scan_counts);
+  std::cout << std::setprecision(4)
+	    << P.commandName() << ","
+	    << "workload=" << w.name << ","
+	    << "round=" << round << ","
+	    << "n=" << n << ","
+	    << "p=" << p << ","
+	    << "z=" << zipfian_param << ",";
+  if (w.scan > 0) std::cout << "max_scan=" << max_scan << ",";
+  if (latency_sample > 0) {
+    for (int op = Read; op <= ReadModifyWrite; op++) {
+      latency_histogram h;
+      for (auto& l : latencies) h.merge(l[op]);
+      if (h.total == 0) continue;
+      auto ns = [&] (double q) {
+	return (long) (h.percentile(q) / cycles_per_ns());};
+      std::cout << op_names[op] << "_p50=" << ns(.5) << ","
+		<< op_names[op] << "_p99=" << ns(.99) << ","
+		<< op_names[op] << "_p999=" << ns(.999) << ",";
+    }
+  }
+  if (reads > 0)
+    std::cout << "found=" << (double) parlay::reduce(found_counts) / reads << ",";
+  if (scans > 0)
+    std::cout << "scan_avg=" << (double) parlay::reduce(scanned_counts) / scans << ",";
+  std::cout << num_ops / (duration * 1e6) << std::endl;
+
+  os.retire(tr);
+  os.clear();
+}
+
+int main(int argc, char* argv[]) {
+  commandLine P(argc,argv,"[-n <records>] [-w <workloads, e.g. ABCDEF>] [-p <procs>] [-tt <trial time>] [-r <rounds>] [-z <zipfian_param>] [-scan <max scan length>] [-lat <sample one in>]");
+  size_t n = P.getOptionLongValue("-n", 1000000);
+  std::string names = P.getOptionValue("-w", std::string("ABCDEF"));
+  int p = P.getOptionIntValue("-p", parlay::num_workers());
+  double trial_time = P.getOptionDoubleValue("-tt", 1.0);
+  int rounds = P.getOptionIntValue("-r", 1);
+  double zipfian_param = P.getOptionDoubleValue("-z", .99);
+  int max_scan = P.getOptionIntValue("-scan", 100);
+  int latency_sample = P.getOptionIntValue("-lat", 0);
+
+  Set<K,V> os;
+  for (char c : names)
+    for (auto& w : workloads)
+      if (w.name == c)
+	for (int r = 0; r < rounds; r++)
+	  run_workload(w, os, n, p, trial_time, zipfian_param, max_scan,
+		       latency_sample, r, P);
+}
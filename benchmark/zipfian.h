@@ -5,6 +5,7 @@
 //  Copyright (c) 2014 Jinglei Ren <jinglei@ren.systems>.
 //
 
+#pragma once
 #include <cassert>
 #include <cmath>
 #include <cstdint>
@@ -46,3 +47,31 @@ public:
   uint64_t items_;
   double theta_, zeta_n_, eta_, alpha_, zeta_2_;
 };
+
+// As in YCSB, popular items are spread over the key space rather than
+// being the smallest ones, by hashing the Zipfian rank.  Unlike YCSB
+// the ranks are drawn over num_items itself, rather than a fixed
+// 10 billion items, since Zeta is computed directly.
+struct ScrambledZipfian {
+  Zipfian z;
+  ScrambledZipfian(uint64_t num_items, double zipfian_const = Zipfian::kZipfianConst)
+    : z(num_items, zipfian_const) {}
+  uint64_t operator () (size_t i) {
+    return parlay::hash64(z(i)) % z.items_;
+  }
+};
+
+// The most recently inserted items are the most popular (YCSB's
+// SkewedLatest).  Given the last item inserted so far, returns the
+// item that is a Zipfian distance before it.  The distances are drawn
+// over the initial number of items, which is a fine approximation as
+// long as relatively few items are inserted.
+struct Latest {
+  Zipfian z;
+  Latest(uint64_t num_items, double zipfian_const = Zipfian::kZipfianConst)
+    : z(num_items, zipfian_const) {}
+  uint64_t operator () (size_t i, uint64_t last) {
+    uint64_t d = z(i);
+    return (d > last) ? 0 : last - d;
+  }
+};
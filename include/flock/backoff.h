@@ -0,0 +1,164 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <parlay/parallel.h>
+
+// ***************************
+// contention managers
+// ***************************
+
+// A backoff decides how long to wait after a failed try_lock (or CAS)
+// before trying again.  A structure creates one per operation and
+// calls wait() after each failed attempt, as in:
+//
+//   Backoff b;
+//   while (true) {
+//     ...
+//     if (lck.try_lock(...)) return true;
+//     b.wait();
+//   }
+//
+// The structures take the backoff type as their third template
+// argument, after the key and value types, e.g. Set<K,V,Backoff>.  Those
+// that always backed off default to flck::default_backoff, and those
+// that retried immediately default to flck::retry_backoff.  Both can
+// be changed with the compiler flags PauseBackoff, AdaptiveBackoff or
+// NoBackoff, and compiling with BackoffStats counts the waits
+// (reported by print_backoff_stats).
+
+namespace flck {
+namespace internal {
+
+#ifdef BackoffStats
+struct alignas(64) backoff_stats_entry {
+  long waits = 0;  // calls to wait()
+  long delay = 0;  // total delay over the waits
+  long yields = 0; // waits that yielded the processor
+};
+
+std::vector<backoff_stats_entry> backoff_stats(parlay::num_workers());
+#endif
+
+inline void record_backoff([[maybe_unused]] int delay,
+			   [[maybe_unused]] bool yielded = false) {
+#ifdef BackoffStats
+  auto& s = backoff_stats[parlay::worker_id()];
+  s.waits++;
+  s.delay += delay;
+  s.yields += yielded;
+#endif
+}
+
+// lets the core know it is in a spin loop (and on x86 yields to the
+// other hyperthread)
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// true if there are more workers than hardware threads, in which case
+// a lock holder is more likely to be descheduled
+inline bool oversubscribed() {
+  static bool r = parlay::num_workers() > std::thread::hardware_concurrency();
+  return r;
+}
+
+} // namespace internal
+
+// retries immediately
+struct no_backoff {
+  void wait() {internal::record_backoff(0);}
+};
+
+// Spins for Init iterations of an empty loop, doubling up to Max on
+// each wait.  This is what the structures always did.
+template <int Init = 200, int Max = 2000>
+struct exponential_backoff {
+  int delay = Init;
+  void wait() {
+    internal::record_backoff(delay);
+    for (volatile int i=0; i < delay; i++);
+    delay = std::min(2*delay, Max);
+  }
+};
+
+// As exponential_backoff but spins on the pause instruction, which
+// takes longer per iteration (up to about 140 cycles on recent x86)
+// and uses less of the core while waiting.
+template <int Init = 8, int Max = 64>
+struct pause_backoff {
+  int delay = Init;
+  void wait() {
+    internal::record_backoff(delay);
+    for (int i=0; i < delay; i++) internal::cpu_relax();
+    delay = std::min(2*delay, Max);
+  }
+};
+
+// Pause based exponential backoff whose initial delay adapts, per
+// thread, to recent contention.  The initial delay is halved after an
+// operation that did not wait (i.e. the backoff was destructed without
+// a wait), and doubled after one that waited more than once.  Once the
+// delay reaches Max it yields the processor instead, if there are more
+// workers than hardware threads.
+template <int Min = 2, int Max = 64>
+struct adaptive_backoff {
+  static inline thread_local int start = Min;
+  int delay;
+  int waits;
+  adaptive_backoff() : delay(start), waits(0) {}
+  ~adaptive_backoff() {
+    if (waits == 0) start = std::max(Min, start / 2);
+    else if (waits > 1) start = std::min(Max, 2 * start);
+  }
+  void wait() {
+    waits++;
+    if (delay == Max && internal::oversubscribed()) {
+      internal::record_backoff(delay, true);
+      std::this_thread::yield();
+    } else {
+      internal::record_backoff(delay);
+      for (int i=0; i < delay; i++) internal::cpu_relax();
+      delay = std::min(2*delay, Max);
+    }
+  }
+};
+
+#if defined(NoBackoff)
+using default_backoff = no_backoff;
+#elif defined(PauseBackoff)
+using default_backoff = pause_backoff<>;
+#elif defined(AdaptiveBackoff)
+using default_backoff = adaptive_backoff<>;
+#else
+using default_backoff = exponential_backoff<>;
+#endif
+
+#if defined(NoBackoff) || defined(PauseBackoff) || defined(AdaptiveBackoff)
+using retry_backoff = default_backoff;
+#else
+using retry_backoff = no_backoff;
+#endif
+
+inline void print_backoff_stats() {
+#ifdef BackoffStats
+  internal::backoff_stats_entry total;
+  for (auto& s : internal::backoff_stats) {
+    total.waits += s.waits;
+    total.delay += s.delay;
+    total.yields += s.yields;
+  }
+  std::cout << "backoff waits = " << total.waits
+	    << ", mean delay = "
+	    << (total.waits == 0 ? 0.0 : ((double) total.delay) / total.waits)
+	    << ", yields = " << total.yields << std::endl;
+#endif
+}
+
+} // namespace flck
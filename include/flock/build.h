@@ -0,0 +1,20 @@
+#pragma once
+#include <parlay/primitives.h>
+
+// Helpers for a structure's bulk build(kvs), which builds it from
+// key-value pairs in any order.  A structure is not shared while it is
+// being built, so a build takes no locks.
+
+namespace flck {
+
+// Sorts kvs by key, keeping only the first of any duplicate keys.
+// KV needs a key field with operator< and operator!=.
+template <typename KV>
+parlay::sequence<KV> sort_unique_keys(parlay::sequence<KV> kvs) {
+  auto s = parlay::stable_sort(kvs, [] (const KV& a, const KV& b) {
+      return a.key < b.key;});
+  return parlay::pack(s, parlay::delayed_tabulate(s.size(), [&] (size_t i) {
+	return i == 0 || s[i].key != s[i-1].key;}));
+}
+
+} // namespace flck
@@ -1,6 +1,7 @@
 #include <atomic>
 #include <vector>
 #include <limits>
+#include <functional>
 #include <parlay/alloc.h>
 #include <parlay/random.h>
 #include <parlay/primitives.h>
@@ -33,10 +34,36 @@ struct alignas(64) epoch_s {
 
   std::vector<announce_slot> announcements;
   std::atomic<long> current_epoch;
+
+  // A combining tree over the announcements with the given fanout.
+  // Each tree node records the latest epoch e for which every worker
+  // below it was seen as either not announced or announced at e (or
+  // later).  Since announcements made after the check read a current
+  // epoch of at least e, the mark stays valid for advancing from e to
+  // e+1.  A worker checks the path from its own group up to the root,
+  // so in the common case advancing costs O(fanout * log P) rather than
+  // a scan of all announcements.  A node that has not been marked (e.g.
+  // a group of idle workers) is checked by descending into it.
+  // Announcements normally only go up, but a helper lowers its own to
+  // the epoch of the thread it helps (set_my_epoch), so it then clears
+  // the marks on the path from its group to the root.  A mark is
+  // rechecked just after it is set in case it raced with a clear.
+  static constexpr int fanout = 8;
+  struct alignas(64) tree_node {
+    std::atomic<long> done;
+    tree_node() : done(-1l) {}
+  };
+  std::vector<std::vector<tree_node>> tree; // level 0 covers announcements
+
   epoch_s() {
     int workers = parlay::num_workers();
     announcements = std::vector<announce_slot>(workers);
     current_epoch = 0;
+    size_t n = workers;
+    do {
+      n = (n + fanout - 1) / fanout;
+      tree.push_back(std::vector<tree_node>(n));
+    } while (n > 1);
   }
 
   long get_current() {
@@ -50,7 +77,14 @@ struct alignas(64) epoch_s {
 
   void set_my_epoch(long e) {
     size_t id = parlay::worker_id();
-    announcements[id].last = e;
+    long old = announcements[id].last.exchange(e);
+    if (e != -1l && (old == -1l || e < old)) {
+      size_t i = id;
+      for (auto& level : tree) {
+	i = i / fanout;
+	level[i].done = -1l;
+      }
+    }
   }
 
   void announce() {
@@ -65,22 +99,51 @@ struct alignas(64) epoch_s {
     announcements[id].last.store(-1l, std::memory_order_release);
   }
 
+  // checks if everyone below node i at the given level is done with
+  // epochs before e, and if so marks the node
+  bool check_node(int level, size_t i, long e) {
+    tree_node& t = tree[level][i];
+    if (t.done.load() >= e) return true;
+    size_t start = i * fanout;
+    if (level == 0) {
+      size_t end = std::min(start + fanout, announcements.size());
+      auto below_done = [&] {
+	for (size_t k = start; k < end; k++) {
+	  long a = announcements[k].last;
+	  if (a != -1l && a < e) return false;
+	}
+	return true;};
+      for (int j=0; j < 2; j++) //do twice
+	if (!below_done()) return false;
+      t.done = e;
+      // a helper might have lowered its announcement since the check
+      if (!below_done()) {t.done = -1l; return false;}
+    } else {
+      size_t end = std::min(start + fanout, tree[level-1].size());
+      for (size_t k = start; k < end; k++)
+	if (!check_node(level-1, k, e)) return false;
+      t.done = e;
+      // or cleared the mark of a child since it was checked
+      for (size_t k = start; k < end; k++)
+	if (tree[level-1][k].done.load() < e) {t.done = -1l; return false;}
+    }
+    return true;
+  }
+
   void update_epoch() {
     size_t id = parlay::worker_id();
-    int workers = parlay::num_workers();
     long current_e = get_current();
-    bool all_there = true;
-    // check if everyone is done with earlier epochs
-    for (int j=0; j<2; j++) //do twice
-      for (int i=0; i < workers; i++)
-      	if ((announcements[i].last != -1l) && announcements[i].last < current_e) 
-      	  all_there = false;
-    // if so then increment current epoch
-    if (all_there) {
-      for (auto h : before_epoch_hooks) h();
-      if (current_epoch.compare_exchange_strong(current_e, current_e+1)) {
-	for (auto h : after_epoch_hooks) h();
-      }
+    // check own group first, and then the path up to the root
+    size_t i = id / fanout;
+    if (!check_node(0, i, current_e)) return;
+    for (int level = 1; level < (int) tree.size(); level++) {
+      i = i / fanout;
+      if (!check_node(level, i, current_e)) return;
+    }
+    // if everyone is done with earlier epochs then increment current epoch
+    for (auto h : before_epoch_hooks) h();
+    if (current_epoch.compare_exchange_strong(current_e, current_e+1)) {
+      for (auto h : after_epoch_hooks) h();
     }
   }
 };
@@ -91,12 +154,39 @@ epoch_s epoch;
 // epoch pools
 // ***************************
 
-struct Link {
-  Link* next;
-  void* value;
+// Number of objects retired but not yet freed, summed across all pools.
+// Each worker only updates its own count.
+struct alignas(64) unreclaimed_count {
+  std::atomic<long> count;
+  unreclaimed_count() : count(0) {}
+  void add(long n) {
+    count.store(count.load(std::memory_order_relaxed) + n,
+		std::memory_order_relaxed);}
 };
 
-using list_allocator = parlay::type_allocator<Link>;
+std::vector<unreclaimed_count> unreclaimed_counts(parlay::num_workers());
+
+void add_unreclaimed(long n) {
+  unreclaimed_counts[parlay::worker_id()].add(n);}
+
+long unreclaimed() {
+  long total = 0;
+  for (auto& c : unreclaimed_counts) total += c.count.load();
+  return total;
+}
+
+// Retired objects are kept in bags, each a linked list of fixed size
+// blocks, so a retire is usually just a store into the current block.
+// The length is chosen so a block fills 2KB.
+constexpr int Retire_Block_Len = 254;
+
+struct retire_block {
+  retire_block* next;
+  long count;
+  void* values[Retire_Block_Len];
+};
+
+using retire_block_allocator = parlay::type_allocator<retire_block>;
 
   using namespace std::chrono;
 
@@ -110,8 +200,8 @@ private:
 
   // each thread keeps one of these
   struct alignas(256) old_current {
-    Link* old;  // linked list of retired items from previous epoch
-    Link* current; // linked list of retired items from current epoch
+    retire_block* old;  // bag of retired items from previous epoch
+    retire_block* current; // bag of retired items from current epoch
     long epoch; // epoch on last retire, updated on a retire
     long count; // number of retires so far, reset on updating the epoch
     sys_time time; // time of last epoch update
@@ -121,13 +211,19 @@ private:
   std::vector<old_current> pools;
   int workers;
 
-  // destructs and frees a linked list of objects 
-  void clear_list(Link* ptr) {
+  // destructs and frees a bag of objects, a block at a time
+  void clear_bag(retire_block* ptr) {
     while (ptr != nullptr) {
-      Link* tmp = ptr;
+      retire_block* tmp = ptr;
       ptr = ptr->next;
-      destruct((T*) tmp->value);
-      list_allocator::free(tmp);
+      // skip the destructor pass if there is nothing to do
+      if constexpr (!std::is_trivially_destructible_v<T>)
+	for (long i = 0; i < tmp->count; i++)
+	  ((T*) tmp->values[i])->~T();
+      for (long i = 0; i < tmp->count; i++)
+	Allocator::free((T*) tmp->values[i]);
+      add_unreclaimed(-tmp->count);
+      retire_block_allocator::free(tmp);
     }
   }
 
@@ -152,7 +248,23 @@ public:
   void acquire(T* p) { }
   
   void reserve(size_t n) { Allocator::reserve(n);}
-  void stats() { Allocator::print_stats();}
+
+  void stats() {
+    Allocator::print_stats();
+    // memory used by the retire bags (not thread safe)
+    size_t blocks = 0;
+    size_t retired = 0;
+    for (auto& pid : pools)
+      for (auto ptr : {pid.old, pid.current})
+	for (; ptr != nullptr; ptr = ptr->next) {
+	  blocks++;
+	  retired += ptr->count;
+	}
+    if (retired > 0)
+      std::cout << "Retired: " << retired << ", bag bytes per retired: "
+		<< ((double) blocks * sizeof(retire_block)) / retired
+		<< std::endl;
+  }
 
   void shuffle(size_t n) {
     n = std::max(n, 1000000ul);
@@ -187,7 +299,7 @@ public:
     auto i = parlay::worker_id();
     auto &pid = pools[i];
     if (pid.epoch < epoch.get_current()) {
-      clear_list(pid.old);
+      clear_bag(pid.old);
       pid.old = pid.current;
       pid.current = nullptr;
       pid.epoch = epoch.get_current();
@@ -201,10 +313,14 @@ public:
       pid.time = now;
       epoch.update_epoch();
     }
-    Link* lnk = list_allocator::alloc();
-    lnk->next = pid.current;
-    lnk->value = (void*) p;
-    pid.current = lnk;
+    if (pid.current == nullptr || pid.current->count == Retire_Block_Len) {
+      retire_block* blk = retire_block_allocator::alloc();
+      blk->next = pid.current;
+      blk->count = 0;
+      pid.current = blk;
+    }
+    pid.current->values[pid.current->count++] = (void*) p;
+    add_unreclaimed(1);
   }
 
   // clears all the lists and terminates the underlying allocator
@@ -212,8 +328,8 @@ public:
   void clear() {
     epoch.update_epoch();
     for (int i=0; i < pools.size(); i++) {
-      clear_list(pools[i].old);
-      clear_list(pools[i].current);
+      clear_bag(pools[i].old);
+      clear_bag(pools[i].current);
       pools[i].old = pools[i].current = nullptr;
     }
     Allocator::finish();
@@ -221,16 +337,30 @@ public:
 };
 
 } // end namespace internal
+} // end namespace flck
+
+#include "ibr.h"
+
+namespace flck {
 
 template <typename Thunk>
 auto with_epoch(Thunk f) {
   internal::epoch.announce();
+#ifdef IBR
+  internal::era.announce();
+#endif
   if constexpr (std::is_void_v<std::invoke_result_t<Thunk>>) {
     f();
     internal::epoch.unannounce();
+#ifdef IBR
+    internal::era.unannounce();
+#endif
   } else {
     auto v = f();
     internal::epoch.unannounce();
+#ifdef IBR
+    internal::era.unannounce();
+#endif
     return v;
   }
 }
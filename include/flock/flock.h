@@ -1,15 +1,29 @@
 // The flock library.
+#pragma once
 
 // Public interface for lock:
 //   with_lock(thunk_returning_val) -> val
 //   try_lock(thunk_returning_boolean) -> boolean
 //   try_lock_result(thunk_returning_val) -> optional<val>
+//   ** results of with_lock and try_lock_result can be any trivially
+//      copyable type
+//   ** validated (optimistic) reads, which run the thunk without
+//      taking the lock and keep its result only if no writer held the
+//      lock meanwhile.  The thunk should only read, and can see a
+//      partial update that is then discarded.  Unlike the above its
+//      result must be a pointer or at most 4 bytes, since helpers agree
+//      on it through a single log entry.
+//   with_validated_read(thunk_returning_val) -> val
+//   try_validated_read(thunk_returning_boolean) -> boolean
+//   try_validated_read_result(thunk_returning_val) -> optional<val>
 //   wait_lock() -> void
 //   is_locked() -> bool
 
 // Supported data types
 
 //  atomic<T> :
+//    T must be a pointer, at most 4 bytes, or 8 bytes (e.g. long or
+//    double, which take 16 bytes with lock-free locks)
 //    atomic(v) : constructor
 //    atomic() : default constructor
 //    load() : return value
@@ -20,10 +34,18 @@
 //    read() : return value, but not idempotent
 //    init(v) : like store(v) but only used before anyone other thread
 //              has a handle to this mutable
+//    read_snapshot() : same as read() unless a persistent pointer
 //    ** the following only needed for snapshotting and only
 //       if trying to optimized code.
 //    validate() : ensures it has a timestamp
 
+//  ptr_type<T> :
+//    An atomic<T*> unless compiling with Persistent, in which case a
+//    persistent_ptr<T> (see persistent.h) whose read_snapshot()
+//    returns the value at the time of the enclosing with_snap.
+//    with_snap(thunk) -> val : with_epoch, but taking a snapshot if
+//       compiling with Persistent
+
 //  ** The following is if a value is only changed once from its
 //     initial value
 //  write_once<T> :
@@ -53,6 +75,7 @@
 #include "lf_lock.h"
 #include "lf_types.h"
 #endif
+#include "backoff.h"
 
 namespace flck {
 
@@ -74,6 +97,9 @@ public:
   template <typename F>
   bool try_lock(F f) {
     return get_lock()->try_lock(f);}
+  template <typename F>
+  bool try_validated_read(F f) {
+    return get_lock()->try_validated_read(f);}
   void wait_lock() { get_lock()->wait_lock(); }
   bool is_locked() { return get_lock()->is_locked(); }
 };
@@ -85,3 +111,21 @@ std::vector<internal::lock> lock::locks{1ul << bucket_bits};
 #endif
 
 } // namespace flck
+
+#ifdef Persistent
+#include "persistent.h"
+#endif
+#include "ptr_type.h"
+#include "upsert.h"
+#include "build.h"
+
+namespace flck {
+
+// The number of lookups a structure's multi_find(root, keys, out, n)
+// keeps in flight.  It interleaves their steps so that their cache
+// misses overlap (asynchronous memory access chaining, Kocberber et
+// al., VLDB 2015), prefetching what a lookup reads next so it is not
+// touched until the lookup's next turn.
+constexpr int multi_find_width = 16;
+
+} // namespace flck
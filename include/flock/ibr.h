@@ -0,0 +1,270 @@
+#pragma once
+#include <atomic>
+#include <limits>
+#include <type_traits>
+#include <vector>
+#include <parlay/alloc.h>
+#include <parlay/parallel.h>
+
+// ***************************
+// interval based reclamation
+// ***************************
+
+// An alternative to the epoch based pool (mem_pool) that bounds the
+// number of unreclaimed objects even if a thread stalls inside of
+// with_epoch.  It is the two-global-era scheme (2GEIBR) from:
+//   Wen, Izraelevitz, Cai, Beadle and Scott,
+//   Interval-Based Memory Reclamation, PPoPP 2018.
+// Each object records the era it was allocated in (its birth), and the
+// era it is retired in.  Each thread in with_epoch reserves the interval
+// of eras from when it entered to the latest era in which it loaded a
+// pointer.  An object is freed once its [birth, retire] interval does not
+// overlap any reservation.  A stalled thread therefore only holds back
+// objects that were live during its reservation rather than everything
+// retired after it stalled.
+//
+// This requires compiling with IBR so that with_epoch makes the
+// reservation and pointer loads from flck::atomic extend it (see
+// protect_read).  With IBR, ibr_pool is the default pool for
+// flck::memory_pool, although mem_pool can still be selected per pool.
+// Descriptors are also kept in an ibr_pool, with helpers inheriting
+// the start of the reservation of the thread they help.
+//
+// A thread running a lock's thunk can read pointers from the log that
+// another thread loaded, possibly in a later era than it reserved.
+// Rather than reserving all later eras while in the thunk, each thread
+// that runs it raises its reservation to the current era when it
+// starts, and the threads that finish it raise the reservations of all
+// that ran it to the era they finished in, before leaving (see
+// descriptor::join and leave).  So a thread stalled anywhere, including
+// inside a thunk, holds back only objects born by the last era its
+// reservation was raised to, and retired after it started.
+
+namespace flck {
+namespace internal {
+
+struct alignas(64) era_s {
+
+  struct alignas(64) reservation {
+    std::atomic<long> lo; // -1 if not reserved
+    std::atomic<long> hi;
+    reservation() : lo(-1l), hi(-1l) {}
+  };
+
+  std::vector<reservation> reservations;
+  std::atomic<long> current_era;
+  era_s() : reservations(parlay::num_workers()), current_era(0) {}
+
+  long get_current() { return current_era.load(); }
+  void advance() { current_era.fetch_add(1); }
+
+  long get_my_lo() { return reservations[parlay::worker_id()].lo.load(); }
+  void set_my_lo(long e) { reservations[parlay::worker_id()].lo = e; }
+
+  // make sure the reservation of worker w covers era e.  Other threads
+  // can raise a reservation (see descriptor::leave), so it only grows.
+  void extend_hi(int w, long e) {
+    auto& hi = reservations[w].hi;
+    long old = hi.load(std::memory_order_relaxed);
+    while (old < e && !hi.compare_exchange_weak(old, e));
+  }
+  void extend_my_hi(long e) { extend_hi(parlay::worker_id(), e); }
+  int num_reservations() { return reservations.size(); }
+
+  void announce() {
+    auto& r = reservations[parlay::worker_id()];
+    long current_e = get_current();
+    r.hi.store(current_e, std::memory_order_relaxed);
+    r.lo.exchange(current_e, std::memory_order_acquire);
+  }
+
+  void unannounce() {
+    reservations[parlay::worker_id()].lo.store(-1l, std::memory_order_release);
+  }
+
+  // Loads a value with load_f making sure the reservation covers
+  // the era it was loaded in, reloading if the era moves on.
+  template <typename F>
+  auto protect(F load_f) {
+    auto& r = reservations[parlay::worker_id()];
+    auto v = load_f();
+    long e = get_current();
+    while (r.hi.load(std::memory_order_relaxed) < e) {
+      extend_my_hi(e);
+      v = load_f();
+      e = get_current();
+    }
+    return v;
+  }
+
+  // the active reservations
+  std::vector<std::pair<long,long>> scan() {
+    std::vector<std::pair<long,long>> result;
+    for (auto& r : reservations) {
+      long lo = r.lo.load();
+      if (lo != -1l) result.push_back(std::make_pair(lo, r.hi.load()));
+    }
+    return result;
+  }
+};
+
+era_s era;
+
+// Loads with f.  If V is a pointer (and compiling with IBR) the load
+// also extends the reservation of the current thread.
+template <typename V, typename F>
+inline auto protect_read(F f) {
+#ifdef IBR
+  if constexpr (std::is_pointer_v<V>) return era.protect(f);
+  else return f();
+#else
+  return f();
+#endif
+}
+
+template <typename xT>
+struct alignas(64) ibr_pool {
+public:
+  using T = xT;
+
+private:
+  // each object is allocated along with its birth era
+  struct wrapper {
+    T value;
+    long birth;
+  };
+  using Allocator = parlay::type_allocator<wrapper>;
+
+  // allocations by a thread between incrementing the era
+  static constexpr long era_frequency = 128;
+
+  struct retired {
+    T* ptr;
+    long retire_era;
+  };
+
+  // each thread keeps one of these
+  struct alignas(64) thread_bag {
+    std::vector<retired> bag;
+    long allocs;  // allocations since last incrementing the era
+    size_t next_scan; // size of bag at which to next try freeing
+    thread_bag() : allocs(0), next_scan(0) {}
+  };
+
+  std::vector<thread_bag> pools;
+  size_t scan_threshold;
+
+  static long birth(T* p) { return ((wrapper*) p)->birth;}
+
+  // frees everything in the bag whose interval does not overlap a
+  // reservation, keeping the rest
+  void empty_bag(thread_bag& pid) {
+    auto reserved = era.scan();
+    size_t j = 0;
+    for (auto r : pid.bag) {
+      long b = birth(r.ptr);
+      bool conflict = false;
+      for (auto [lo, hi] : reserved)
+	if (b <= hi && r.retire_era >= lo) {
+	  conflict = true;
+	  break;
+	}
+      if (conflict) pid.bag[j++] = r;
+      else destruct(r.ptr);
+    }
+    add_unreclaimed(j - (long) pid.bag.size());
+    pid.bag.resize(j);
+    // amortize the cost of scanning over at least scan_threshold retires
+    pid.next_scan = j + scan_threshold;
+  }
+
+public:
+  ibr_pool() {
+    int workers = parlay::num_workers();
+    scan_threshold = 2 * workers + 64;
+    pools = std::vector<thread_bag>(workers);
+    for (auto& pid : pools) pid.next_scan = scan_threshold;
+  }
+
+  ibr_pool(const ibr_pool&) = delete;
+  ~ibr_pool() { clear(); }
+
+  // noop since the reservation is used for the whole operation
+  void acquire(T* p) { }
+
+  void reserve(size_t n) { Allocator::reserve(n);}
+
+  void stats() {
+    Allocator::print_stats();
+    size_t retired = 0;
+    for (auto& pid : pools) retired += pid.bag.size();
+    std::cout << "Retired: " << retired << ", era: " << era.get_current()
+	      << std::endl;
+  }
+
+  void shuffle(size_t n) {
+    n = std::max(n, 1000000ul);
+    auto ptrs = parlay::tabulate(n, [&] (size_t i) {return Allocator::alloc();});
+    ptrs = parlay::random_shuffle(ptrs);
+    parlay::parallel_for(0, n, [&] (size_t i) {Allocator::free(ptrs[i]);});
+  }
+
+  // destructs and frees the object immediately
+  void destruct(T* p) {
+    p->~T();
+    Allocator::free((wrapper*) p);
+  }
+
+  template <typename ... Args>
+  T* new_obj(Args... args) {
+    auto& pid = pools[parlay::worker_id()];
+    if (++pid.allocs == era_frequency) {
+      pid.allocs = 0;
+      era.advance();
+    }
+    wrapper* newv = Allocator::alloc();
+    new (&newv->value) T(args...);
+    newv->birth = era.get_current();
+    // the allocating thread can use the object without loading it
+    era.extend_my_hi(newv->birth);
+    return &newv->value;
+  }
+
+  template <typename F, typename ... Args>
+  // f is a function that initializes a new object before it is shared
+  T* new_init(F f, Args... args) {
+    T* x = new_obj(args...);
+    f(x);
+    return x;
+  }
+
+  // freeing is delayed until no reservation overlaps the object's interval
+  void retire(T* p) {
+    auto& pid = pools[parlay::worker_id()];
+    pid.bag.push_back(retired{p, era.get_current()});
+    add_unreclaimed(1);
+    if (pid.bag.size() >= pid.next_scan) empty_bag(pid);
+  }
+
+  // clears all the bags and terminates the underlying allocator
+  // to be used on termination
+  void clear() {
+    for (auto& pid : pools) {
+      for (auto r : pid.bag) destruct(r.ptr);
+      add_unreclaimed(- (long) pid.bag.size());
+      pid.bag.clear();
+    }
+    Allocator::finish();
+  }
+};
+
+#ifdef IBR
+template <typename T>
+using default_pool = ibr_pool<T>;
+#else
+template <typename T>
+using default_pool = mem_pool<T>;
+#endif
+
+} // end namespace internal
+} // end namespace flck
@@ -3,17 +3,23 @@
 //   with_lock(thunk_returning_val) -> val
 //   try_lock(thunk_returning_boolean) -> boolean
 //   try_lock_result(thunk_returning_val) -> optional<val>
+//   with_validated_read(thunk_returning_val) -> val
+//   try_validated_read(thunk_returning_boolean) -> boolean
+//   try_validated_read_result(thunk_returning_val) -> optional<val>
 //   wait_lock() -> void
 //   is_locked() -> bool
 //   is_self_locked() -> bool
 
+#include <algorithm>
 #include <atomic>
-#include <functional>
+#include <cstring>
 #include <assert.h>
 #include "lf_log.h"
 #include "tagged.h"
 #include "lf_types.h"
 #include "acquired_pool.h"
+#include "backoff.h"
+#include "stall.h"
 
 namespace flck {
 namespace internal {
@@ -28,9 +34,18 @@ static thread_local bool helping = false;
 using lock_entry_ = size_t;
 struct lock; // for back reference
 
+// Size in bytes of the buffer used to store a thunk inline in a
+// descriptor.  Covers the captures of the thunks used by all the
+// structures.  Larger thunks are stored in a pooled allocation.
+constexpr int Thunk_Len = 96;
+
 // stores the thunk along with the log
 struct descriptor {
-  std::function<void()> f;  // the thunk to run
+  // The thunk is type erased into an inline buffer so that creating a
+  // descriptor never needs to go to the heap (as std::function can).
+  alignas(16) char thunk[Thunk_Len];
+  void (*run_thunk)(void*);     // runs the thunk stored in the buffer
+  void (*destroy_thunk)(void*); // destructs (and frees if pooled) the thunk
   bool done;  // set when done
   bool freed; // just for debugging
   // Used for memory management to indicate the thunk is being helped.
@@ -42,25 +57,85 @@ struct descriptor {
   int thread_id; // used to detect reentrant locks, inherited by helpers
   lock_entry_ current; // currently not used
   long epoch_num; // the epoch when initially created, inherited by helpers
+#ifdef IBR
+  long era_lo; // start of creator's era reservation, inherited by helpers
+  // workers (mod Runner_Bits) that ran, or are about to run, the thunk
+  static constexpr int Runner_Bits = 256;
+  std::atomic<size_t> runners[Runner_Bits / 64];
+#endif
   log_array lg_array; // the log itself
-  
+
   template <typename Thunk>
-  descriptor(Thunk& g) : 
-    done(false), freed(false), f([=] {g();}) {
+  static constexpr bool fits_inline() {
+    return (sizeof(Thunk) <= Thunk_Len && alignof(Thunk) <= 16);
+  }
+
+  template <typename Thunk>
+  descriptor(Thunk& g) : done(false), freed(false) {
+    if constexpr (fits_inline<Thunk>()) {
+      new (thunk) Thunk(g);
+      run_thunk = [] (void* t) { (*((Thunk*) t))(); };
+      destroy_thunk = [] (void* t) { ((Thunk*) t)->~Thunk(); };
+    } else { // too large, keep a pointer to a pooled copy in the buffer
+      Thunk* t = parlay::type_allocator<Thunk>::alloc();
+      new (t) Thunk(g);
+      *((Thunk**) thunk) = t;
+      run_thunk = [] (void* t) { (**((Thunk**) t))(); };
+      destroy_thunk = [] (void* t) {
+	Thunk* x = *((Thunk**) t);
+	x->~Thunk();
+	parlay::type_allocator<Thunk>::free(x);
+      };
+    }
     lg_array.init();
     epoch_num = epoch.get_my_epoch();
+#ifdef IBR
+    era_lo = era.get_my_lo();
+    for (auto& r : runners) r = 0;
+#endif
     thread_id = current_id;
   }
 
+  // With IBR, called by a thread before it can run the thunk (and
+  // before an owner's acquiring CAS).  Records it as a runner, and
+  // reserves up to the current era, which covers all pointers in the
+  // log if the thunk is not yet done.  See ibr.h.
+  void join() {
+#ifdef IBR
+    int w = parlay::worker_id() % Runner_Bits;
+    runners[w / 64].fetch_or(1ul << (w % 64));
+    era.extend_my_hi(era.get_current());
+#endif
+  }
+
+  // With IBR, called by a thread that ran the thunk before it clears the
+  // lock.  Raises the reservations of all runners to the current era so
+  // they cover the pointers this thread committed to the log once it
+  // leaves.
+  void leave() {
+#ifdef IBR
+    long e = era.get_current();
+    int n = era.num_reservations();
+    for (int i=0; i < Runner_Bits / 64; i++) {
+      size_t bits = runners[i].load();
+      for (int j=0; bits != 0; j++, bits >>= 1)
+	if (bits & 1)
+	  for (int w = 64 * i + j; w < n; w += Runner_Bits)
+	    era.extend_hi(w, e);
+    }
+#endif
+  }
+
   ~descriptor() { // just for debugging
     assert(!freed);
+    destroy_thunk(thunk);
     freed = true;
   }
 
   void operator () () {
     assert(!freed);
-    // run f using log based on lg_array
-    with_log(Log(&lg_array,0), f);
+    // run the thunk using log based on lg_array
+    with_log(Log(&lg_array,0), [&] {run_thunk(thunk);});
     done = true;
     //std::atomic_thread_fence(std::memory_order_seq_cst);
   }
@@ -78,6 +153,62 @@ memory_pool<descriptor> descriptor_pool;
 memory_pool<descriptor,acquired_pool<descriptor>> descriptor_pool;
 #endif
 
+// Commits an optional result to a single log entry so all helpers
+// agree on it.  The result must be a pointer or at most 4 bytes.
+template <typename RT>
+std::optional<RT> commit_optional(std::optional<RT> r) {
+  if (lg.is_empty()) return r;
+  constexpr size_t has_bit = (1ul << 49); // bit 48 used by commit_value_safe
+  size_t x = 0;
+  if (r.has_value()) {
+    std::memcpy(&x, &(*r), sizeof(RT));
+    x |= has_bit;
+  }
+  x = lg.commit_value_safe(x).first;
+  if (!(x & has_bit)) return {};
+  x &= ~has_bit;
+  RT v;
+  std::memcpy(&v, &x, sizeof(RT));
+  return v;
+}
+
+// A result of a lock that does not fit in the tag of the log entry
+// holding the descriptor (see memory_pool::tag_result) is passed to
+// later helpers of the enclosing lock in log entries reserved right
+// after that entry, 4 bytes per entry.  The owner writes them before
+// tagging the descriptor's entry as done, and helpers that find it
+// done read them back.  Nothing is reserved outside of a lock.
+template <typename RT>
+struct result_log {
+  static constexpr bool small = (sizeof(RT) <= 4 || std::is_pointer<RT>::value);
+  static constexpr int len = small ? 0 : (sizeof(RT) + 3) / 4;
+  Log start;
+  result_log() : start(lg) {
+    if (!lg.is_empty())
+      for (int i=0; i < len; i++) lg.next_entry();
+  }
+  // the set bit keeps an entry from being zero
+  void write(const RT& r) {
+    Log l = start;
+    char* bytes = (char*) &r;
+    for (int i=0; i < len; i++) {
+      size_t x = 0;
+      std::memcpy(&x, bytes + 4*i, std::min<int>(4, sizeof(RT) - 4*i));
+      l.next_entry()->store((void*) (x | (1ul << 48)));
+    }
+  }
+  RT read() {
+    RT r;
+    Log l = start;
+    char* bytes = (char*) &r;
+    for (int i=0; i < len; i++) {
+      size_t x = (size_t) l.next_entry()->load();
+      std::memcpy(bytes + 4*i, &x, std::min<int>(4, sizeof(RT) - 4*i));
+    }
+    return r;
+  }
+};
+
 struct lock {
 public:
     using lock_entry = lock_entry_;
@@ -86,15 +217,28 @@ private:
   // to avoid ABA issues
   using Tag = tagged<descriptor*>;
   std::atomic<lock_entry> lck;
-  lock_entry load() {return lg.commit_value(lck.load()).first;}
-  lock_entry read() {return lck.load();}
+  lock_entry load() {return lg.commit_value(read()).first;}
+  lock_entry read() { // protects the descriptor if using IBR
+    return protect_read<descriptor*>([&] {return lck.load();});}
 
-  // used to take lock for version with helping
-  bool cas(lock_entry oldl, descriptor* d) {
+  // Used to take lock for version with helping.  with_lock can retry
+  // a different number of times in each helper, so its attempts cannot
+  // each take an entry of the enclosing log (if any), which would put
+  // the helpers' logs out of step.  Instead all attempts share the one
+  // entry reserved by acquire_entry(), so once one helper acquires the
+  // lock for d the others skip the CAS, and a late one cannot take the
+  // lock again after d is done.  The write is announced so the tag is
+  // not reused under a delayed CAS (see tagged.h).
+  bool cas(lock_entry oldl, descriptor* d, log_entry* acquired) {
     lock_entry current = read();
     if (current != oldl) return false;
-    return Tag::cas(lck, oldl, d);
+    return Tag::cas_until_success(lck, oldl, d, acquired);
   }
+
+  // the entry shared by the attempts to acquire the lock, null if not
+  // in a log
+  static log_entry* acquire_entry() {
+    return lg.is_empty() ? nullptr : lg.next_entry();}
   
   void clear(descriptor* d) {
     lock_entry current = lck.load();
@@ -105,10 +249,10 @@ private:
   }
 
   bool is_locked_(lock_entry le) { return Tag::value(le) != nullptr;}
-  descriptor* remove_tag(lock_entry le) { return Tag::value(le);}
   bool lock_is_self(lock_entry le) {
     return current_id == remove_tag(le)->thread_id;
   }
+  descriptor* remove_tag(lock_entry le) { return Tag::value(le);}
 
   // runs thunk in appropriate epoch and after it is acquired
   bool help_descriptor(lock_entry le, bool recursive_help=false) {
@@ -120,22 +264,73 @@ private:
     long other_epoch = desc->epoch_num;
     if (other_epoch < my_epoch)
       epoch.set_my_epoch(other_epoch); // inherit epoch of helpee
+#ifdef IBR
+    long my_lo = era.get_my_lo();
+    if (desc->era_lo != -1 && desc->era_lo < my_lo)
+      era.set_my_lo(desc->era_lo); // inherit era reservation of helpee
+#endif
     int my_id = current_id; 
     current_id = desc->thread_id;   // inherit thread id of helpee
     descriptor_pool.acquire(desc);  // mark descriptor as acquired
+    desc->join();
     still_locked = (read() == le);
     if (still_locked) {
       bool hold_h = helping; 
       helping = true; // mark as in helping mode
       (*desc)();      // run thunk to be helped
+      desc->leave();
       clear(desc);    // unset the lock
       helping = hold_h; // reset helping mode
     }
     current_id = my_id; // reset thread id
     epoch.set_my_epoch(my_epoch); // reset to my epoch
+#ifdef IBR
+    era.set_my_lo(my_lo); // reset to my reservation
+#endif
     return still_locked; // return true if did helping
   }
 
+  // Retires a descriptor, passing the result to any later helpers.
+  // Only the owner (i_own not null) saves the result.
+  template <typename RT>
+  void retire_with_result(descriptor* d, log_entry* i_own,
+			  result_log<RT>& rlog, std::optional<RT> result) {
+    if constexpr (result_log<RT>::small)
+      descriptor_pool.retire_acquired_result(d, i_own, result);
+    else {
+      if (i_own != nullptr && result.has_value()) rlog.write(*result);
+      descriptor_pool.retire_acquired_result(d, i_own,
+	result.has_value() ? std::optional<bool>(true) : std::optional<bool>());
+    }
+  }
+
+  // The result saved by retire_with_result for an already retired
+  // descriptor.
+  template <typename RT>
+  std::optional<RT> done_result(descriptor* d, result_log<RT>& rlog) {
+    if constexpr (result_log<RT>::small)
+      return descriptor_pool.done_val_result<RT>(d);
+    else if (descriptor_pool.done_val_result<bool>(d).has_value())
+      return rlog.read();
+    else return {};
+  }
+
+  // runs f as a validated read without logging, see
+  // try_validated_read_result
+  template <typename Thunk>
+  auto try_validated(Thunk& f) {
+    using RT = decltype(f());
+    lock_entry current = read();
+    if (is_locked_(current)) {
+      if (lock_is_self(current)) return std::optional<RT>(f());
+      help_descriptor(current);
+      return std::optional<RT>();
+    }
+    RT result = f();
+    if (read() != current) return std::optional<RT>();
+    return std::optional<RT>(result);
+  }
+
 public:
   lock() : lck(Tag::init(nullptr)) {}
   
@@ -162,39 +357,48 @@ public:
   // done (my_thunk->done).  It is lock free if no cycles in lock
   // ordering, and otherwise can deadlock.
   template <typename Thunk>
-  auto with_lock(Thunk f) {
+  auto with_lock(Thunk f, call_site site = call_site::here()) {
     using RT = decltype(f());
-    static_assert(sizeof(RT) <= 4 || std::is_pointer<RT>::value,
-		  "Result of with_lock must be a pointer or at most 4 bytes");
+    static_assert(std::is_trivially_copyable<RT>::value,
+		  "Result of with_lock must be trivially copyable");
     lock_entry current = read();
 
-    // idempotently allocate descriptor
+    // idempotently allocate descriptor, room for a large result, and
+    // the entry for acquiring the lock
     auto [my_descriptor, i_own] = descriptor_pool.new_obj_acquired(f);
+    result_log<RT> rlog;
+    log_entry* acquired = acquire_entry();
     
     // if already retired, then done
     if (descriptor_pool.is_done(my_descriptor)) {
-	auto ret_val = descriptor_pool.done_val_result<RT>(my_descriptor);
+	auto ret_val = done_result(my_descriptor, rlog);
 	assert(ret_val.has_value()); // with_lock is guaranteed to succeed
 	return ret_val.value(); 
     }
+    my_descriptor->join();
     
     bool locked = is_locked_(current);
     while (true) {
       if (my_descriptor->done // already done
 	  || remove_tag(current) == my_descriptor // already acquired
-	  || (!locked && cas(current, my_descriptor))) { // try to acquire
+	  || (!locked && cas(current, my_descriptor, acquired))) { // try to acquire
+	maybe_stall();
 
 	// run the body f with the log from my_descriptor
 	RT result = with_log(Log(&my_descriptor->lg_array,0), [&] {return f();});
 
 	// mark as done and clear the lock
 	my_descriptor->done = true;
+#ifdef LogStats
+	record_log_stats(site, &my_descriptor->lg_array);
+#endif
+	my_descriptor->leave();
 	clear(my_descriptor);
 
 	// retire the descriptor saving the result in the enclosing
 	// descriptor, if any
-	descriptor_pool.retire_acquired_result(my_descriptor, i_own,
-					       std::optional<RT>(result));
+	retire_with_result(my_descriptor, i_own, rlog,
+			   std::optional<RT>(result));
 	return result;
       } else if (locked) {
 	help_descriptor(current);
@@ -204,11 +408,55 @@ public:
     }
   }
 
+  // Validated read.  This is an optimistic read, not a reader lock:
+  // f runs without taking the lock, so it can see a partial update by
+  // a writer, and its result is kept only if no writer held the lock
+  // at any time during f.  That holds if the lock entry is free before
+  // f and unchanged after it, since every acquisition changes the tag.
+  // Readers never write the lock, so they never delay a writer.  If
+  // the lock is held the reader helps the owner (if it can) and fails.
+  // f must only read, and must not act on what it reads (e.g. loop on
+  // it) before it is validated.  Its reads are not logged, instead the
+  // result is committed, so the result must be a pointer or at most 4
+  // bytes.  A thread that holds the lock runs f directly.  The NoHelp
+  // lock (spin_lock.h) has the same semantics.
+  template <typename Thunk>
+  auto try_validated_read_result(Thunk f) {
+    using RT = decltype(f());
+    static_assert(sizeof(RT) <= 4 || std::is_pointer<RT>::value,
+		  "Result of try_validated_read must be a pointer or at most 4 bytes");
+    return commit_optional(with_empty_log([&] {return try_validated(f);}));
+  }
+
+  template <typename Thunk>
+  bool try_validated_read(Thunk f) {
+    auto result = try_validated_read_result(f);
+    return result.has_value() && result.value();
+  }
+
+  // Retries, with backoff, until no writer intervenes.
+  template <typename Thunk>
+  auto with_validated_read(Thunk f) {
+    using RT = decltype(f());
+    static_assert(sizeof(RT) <= 4 || std::is_pointer<RT>::value,
+		  "Result of with_validated_read must be a pointer or at most 4 bytes");
+    RT result = with_empty_log([&] {
+	default_backoff b;
+	while (true) {
+	  auto r = try_validated(f);
+	  if (r.has_value()) return r.value();
+	  b.wait();
+	}});
+    return commit_optional(std::optional<RT>(result)).value();
+  }
+
   // The thunk returns a value
   // The try_lock_result returns an optional value, which is empty if it fails
   template <typename Thunk>
-  auto try_lock_result(Thunk f) {
+  auto try_lock_result(Thunk f, call_site site = call_site::here()) {
     using RT = decltype(f());
+    static_assert(std::is_trivially_copyable<RT>::value,
+		  "Result of try_lock_result must be trivially copyable");
     std::optional<RT> result = {};
     lock_entry current = load();
 
@@ -216,42 +464,52 @@ public:
     if (is_locked_(current) && lock_is_self(current)) 
       return std::optional(f()); // if so, run without acquiring
 
-    // Idempotent allocation of descriptor.  
+
+    // Idempotent allocation of descriptor, room for a large result, and
+    // the entry for acquiring the lock.
     auto [my_descriptor, i_own] = descriptor_pool.new_obj_acquired(f);
+    result_log<RT> rlog;
+    log_entry* acquired = acquire_entry();
     
     // if descriptor is already retired, then done and return value
     if (descriptor_pool.is_done(my_descriptor)) 
-      return descriptor_pool.done_val_result<RT>(my_descriptor);
+      return done_result(my_descriptor, rlog);
 	
     if (!is_locked_(current)) {
-      // use a CAS to try to acquire the lock
-      cas(current, my_descriptor);
+      my_descriptor->join();
+
+      // use a CAS to try to acquire the lock (true if some helper did)
+      bool took = cas(current, my_descriptor, acquired);
 
       // This could be a load() without the my_descriptor->done test.
       // Using read() is an optimization to avoid a logging event.
       current = read();
-      if (my_descriptor->done || remove_tag(current) == my_descriptor) {
+      if (took || my_descriptor->done || remove_tag(current) == my_descriptor) {
+	maybe_stall();
 
 	// run f with log from my_descriptor
-	result = with_log(Log(&my_descriptor->lg_array,0),
-			  [&] {return f();});
+	result = with_log(Log(&my_descriptor->lg_array,0), [&] {return f();});
 
 	// mark as done and clear the lock
 	my_descriptor->done = true;
+#ifdef LogStats
+	record_log_stats(site, &my_descriptor->lg_array);
+#endif
+	my_descriptor->leave();
 	clear(my_descriptor);
       }
     } else help_descriptor(current);
 
     // retire the thunk
-    descriptor_pool.retire_acquired_result(my_descriptor, i_own, result);
+    retire_with_result(my_descriptor, i_own, rlog, result);
     return result;
   }
 
   // A wrapper that returns true if the try_lock succeeds and its thunk
   // returns true.
   template <typename Thunk>
-  auto try_lock(Thunk f) {
-    auto result = try_lock_result(f);
+  auto try_lock(Thunk f, call_site site = call_site::here()) {
+    auto result = try_lock_result(f, site);
     return result.has_value() && result.value();
   }
 };
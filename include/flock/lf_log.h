@@ -1,5 +1,9 @@
 #pragma once
 #include <atomic>
+#ifdef LogStats
+#include <map>
+#include <string>
+#endif
 #include "epoch.h"
 
 namespace flck {
@@ -91,7 +95,7 @@ struct Log {
   template<typename V>
   std::pair<V,bool> commit_value(V newv) {
     if (is_empty()) return std::make_pair(newv, true);
-    assert(newv != nullptr); // check not committing 0
+    assert((void*) newv != nullptr); // check not committing 0
     log_entry* l = next_entry();
     void* oldv = l->load();
     if (oldv == nullptr && l->compare_exchange_strong(oldv, (void*) newv))
@@ -176,6 +180,66 @@ bool skip_if_done(F f) {
   return false;
 }
 
+// The location of a call to try_lock or with_lock.  The default
+// arguments are filled in at the call site.
+struct call_site {
+  const char* file;
+  int line;
+  static constexpr call_site here(const char* file = __builtin_FILE(),
+				  int line = __builtin_LINE()) {
+    return call_site{file, line};}
+};
+
+#ifdef LogStats
+// Counts the log entries committed by the critical sections started
+// at each call site, and how many of them spilled past the first
+// log_array (i.e. had to allocate another).
+struct log_site_stats {
+  long locks = 0;
+  long entries = 0;
+  long max_entries = 0;
+  long spills = 0;
+};
+
+struct alignas(64) log_stats_table {
+  std::map<std::pair<const char*,int>, log_site_stats> sites;
+};
+
+std::vector<log_stats_table> log_stats(parlay::num_workers());
+
+// called by the owner of a lock after its thunk is done
+void record_log_stats(call_site site, log_array* la) {
+  long entries = 0;
+  bool spilled = (la->next.load() != nullptr);
+  for (; la != nullptr; la = la->next.load())
+    for (int i = 0; i < Log_Len; i++)
+      if ((*la)[i].load() != nullptr) entries++;
+  auto& s = log_stats[parlay::worker_id()].sites[std::make_pair(site.file, site.line)];
+  s.locks++;
+  s.entries += entries;
+  s.max_entries = std::max(s.max_entries, entries);
+  s.spills += spilled;
+}
+
+void print_log_stats() {
+  std::map<std::pair<std::string,int>, log_site_stats> totals;
+  for (auto& t : log_stats)
+    for (auto& [site, s] : t.sites) {
+      auto& x = totals[std::make_pair(std::string(site.first), site.second)];
+      x.locks += s.locks;
+      x.entries += s.entries;
+      x.max_entries = std::max(x.max_entries, s.max_entries);
+      x.spills += s.spills;
+    }
+  for (auto& [site, s] : totals)
+    std::cout << "log entries at " << site.first << ":" << site.second
+	      << ", locks = " << s.locks
+	      << ", per lock = " << ((double) s.entries) / s.locks
+	      << ", max = " << s.max_entries
+	      << ", spilled = " << ((double) s.spills) / s.locks << std::endl;
+}
+#endif
+
 // runs read only code without the log, and commits the result to the log
 template <typename V, typename Thunk>
 static V read_only(Thunk f) {
@@ -1,36 +1,46 @@
 #include <atomic>
+#include <cstring>
+#include <tuple>
 #include "tagged.h"
 #include "lf_log.h"
+#include "backoff.h"
 
 #pragma once
 
 namespace flck {
 
-template <typename V>
+// 8 byte values other than pointers use the specialization below
+template <typename V,
+	  bool Wide = (sizeof(V) == 8 && !std::is_pointer<V>::value)>
 struct atomic {
 private:
   using IT = size_t;
   using TV = internal::tagged<V>;
 
   IT get_val(internal::Log &p) {
-    return p.commit_value(v.load()).first; }
+    return p.commit_value(load_protected()).first; }
+
+  // protect the raw load (if using IBR) before committing it to
+  // the log so all helpers commit the same value
+  IT load_protected() {
+    return internal::protect_read<V>([&] {return v.load();});}
 
 public:
   std::atomic<IT> v;
   static_assert(sizeof(V) <= 4 || std::is_pointer<V>::value,
-    "Type for mutable must be a pointer or at most 4 bytes");
+    "Type for mutable must be a pointer, at most 4 bytes or 8 bytes");
 
   // not much to it.  heavy lifting done in TV
   atomic(V vv) : v(TV::init(vv)) {}
   atomic() : v(TV::init(0)) {}
   void init(V vv) {v = TV::init(vv);}
   V load() {return TV::value(get_val(internal::lg));}
-  V load_ni() {return TV::value(v.load());}
-  V read() {return TV::value(v.load());}
-  V read_snapshot() {return TV::value(v.load());}
+  V load_ni() {return TV::value(load_protected());}
+  V read() {return TV::value(load_protected());}
+  V read_snapshot() {return TV::value(load_protected());}
   void store(V vv) {TV::cas(v, get_val(internal::lg), vv);}
   bool cas(V old_v, V new_v) { // not safe inside locks
-    assert(internal::log.is_empty());
+    assert(internal::lg.is_empty());
     return cas_ni(old_v, new_v);
   }
   bool cas_ni(V old_v, V new_v) { 
@@ -49,6 +59,122 @@ public:
   // operator V() { return load(); } // implicit conversion
 };
 
+// 8 byte values (e.g. long, double or a timestamp) leave no room for
+// a tag, so the value is kept next to a version count, which is used
+// instead of the tag, and both are updated with a 16 byte CAS
+// (cmpxchg16b).  A load commits the value to two log entries, each
+// holding half of it along with the low 16 bits of its count, so all
+// helpers agree on one version (see commit_bits).  As with the tagged
+// version the value should only be changed while holding a lock, or
+// with cas_ni outside of locks.  Values are compared bitwise.
+template <typename V>
+struct atomic<V, true> {
+private:
+  using IT = size_t;
+  struct alignas(16) TV {IT count; IT val;};
+  TV v;
+
+  static IT to_bits(V x) {IT r; std::memcpy(&r, &x, sizeof(V)); return r;}
+  static V from_bits(IT x) {V r; std::memcpy(&r, &x, sizeof(V)); return r;}
+  IT get_count() {return __atomic_load_n(&v.count, __ATOMIC_SEQ_CST);}
+  IT get_bits() {return __atomic_load_n(&v.val, __ATOMIC_SEQ_CST);}
+
+  bool cas_(TV oldv, TV newv) {
+    __int128 oldvi, newvi;
+    std::memcpy(&oldvi, &oldv, sizeof(TV));
+    std::memcpy(&newvi, &newv, sizeof(TV));
+    return __sync_bool_compare_and_swap((__int128*) &v, oldvi, newvi);
+  }
+
+  // the count starts at 1 so it is never zero
+  IT commit_count() {
+    return (IT) internal::lg.commit_value((void*) get_count()).first;}
+
+  // a consistent count and value, without writing
+  TV snapshot() {
+    while (true) {
+      IT c = get_count();
+      IT x = get_bits();
+      if (get_count() == c) return TV{c, x};
+    }
+  }
+
+  // half (0 for low, 1 for high) of x tagged with the low bits of its
+  // count c, and a set bit so it is not zero
+  static IT half(IT c, IT x, int h) {
+    return (1ul << 48) | ((c & 0xffff) << 32) | ((x >> (32 * h)) & 0xffffffff);}
+  static bool same_count(IT e, IT c) {return ((e >> 32) & 0xffff) == (c & 0xffff);}
+
+  static IT commit_entry(internal::log_entry* e, IT x) {
+    void* old = e->load();
+    if (old == nullptr && e->compare_exchange_strong(old, (void*) x)) return x;
+    return (IT) old;
+  }
+
+  // Commits the value read by a load into two reserved log entries.
+  // The first committed low half fixes the version, and a helper only
+  // commits the high half from a snapshot of that same version.  A
+  // helper that sees a later version re-reads until the high half is
+  // committed.  The version only moves on during the thunk through its
+  // own stores, which follow the commit, unless the value is also
+  // changed outside of the lock (with cas_ni), in which case a helper
+  // can wait for the one that committed the low half.
+  IT commit_bits() {
+    if (internal::lg.is_empty()) return get_bits();
+    TV x = snapshot();
+    internal::log_entry* e1 = internal::lg.next_entry();
+    internal::log_entry* e2 = internal::lg.next_entry();
+    IT lo = commit_entry(e1, half(x.count, x.val, 0));
+    IT hi = (IT) e2->load();
+    while (hi == 0) {
+      if (same_count(lo, x.count)) hi = commit_entry(e2, half(x.count, x.val, 1));
+      else {
+	internal::cpu_relax();
+	x = snapshot();
+	hi = (IT) e2->load();
+      }
+    }
+    return ((hi & 0xffffffff) << 32) | (lo & 0xffffffff);
+  }
+
+public:
+  atomic(V vv) : v{1, to_bits(vv)} {}
+  atomic() : v{1, 0} {}
+  void init(V vv) {v.count = 1; v.val = to_bits(vv);}
+  V load() {return from_bits(commit_bits());}
+  V load_ni() {return from_bits(get_bits());}
+  V read() {return from_bits(get_bits());}
+  V read_snapshot() {return from_bits(get_bits());}
+  void store(V vv) {
+    IT cnt = commit_count();
+    internal::skip_if_done_no_log([&] {
+	cas_({cnt, get_bits()}, {cnt+1, to_bits(vv)});});
+  }
+  bool cas(V old_v, V new_v) { // not safe inside locks
+    assert(internal::lg.is_empty());
+    return cas_ni(old_v, new_v);
+  }
+  bool cas_ni(V old_v, V new_v) {
+    IT old_b = to_bits(old_v);
+    while (true) {
+      TV cur = {get_count(), get_bits()};
+      if (cur.val != old_b) return false;
+      if (cas_(cur, {cur.count+1, to_bits(new_v)})) return true;
+    }
+  }
+  void cam(V oldv, V newv) {
+    IT cnt = commit_count();
+    IT cur = commit_bits();
+    if (cur == to_bits(oldv))
+      internal::skip_if_done_no_log([&] {
+	  cas_({cnt, cur}, {cnt+1, to_bits(newv)});});
+  }
+  V operator=(V b) {store(b); return b; }
+
+  // compatibility with multiversioning
+  void validate() {}
+};
+
 template <typename V>
 struct atomic_double {
 private:
@@ -93,11 +219,13 @@ public:
   std::atomic<V> v;
   atomic_write_once(V initial) : v(initial) {}
   atomic_write_once() {}
+  V load_protected() {
+    return internal::protect_read<V>([&] {return v.load();});}
   V load() { // set then mask high bit to ensure not zero
-    size_t x = internal::lg.commit_value((size_t) v.load() | set_bit).first;
+    size_t x = internal::lg.commit_value((size_t) load_protected() | set_bit).first;
     return (V) (x & ~set_bit);
   }
-  V load_ni() {return v.load();}
+  V load_ni() {return load_protected();}
   void init(V vv) { v = vv; }
   void store(V vv) { v = vv; }
   bool cas_ni(V exp_v, V new_v) {return v.compare_exchange_strong(exp_v, new_v);}
@@ -114,7 +242,7 @@ public:
    struct lock;
  }
  
-template <typename T, typename Pool=internal::mem_pool<T>>
+template <typename T, typename Pool=internal::default_pool<T>>
 struct memory_pool {
   Pool pool;
 
@@ -213,8 +341,14 @@ protected:
   template <typename RT>
   std::optional<RT> done_val_result(T* p) {
     auto r = extract_result(p);
-    if (r.has_value()) return (RT) r.value();
-    else return {};
+    if (!r.has_value()) return {};
+    if constexpr (std::is_pointer<RT>::value) return (RT) r.value();
+    else {
+      RT v;
+      size_t x = r.value();
+      std::memcpy(&v, &x, sizeof(RT));
+      return v;
+    }
   }
   
 private:
@@ -251,11 +385,18 @@ private:
   }
 
   // a poor mans "optional".  The flag at the 48th bit indicates presence,
-  // and the lower 48 bits are the value if present.
+  // and the lower 48 bits are the value if present.  Values other than
+  // pointers are copied bitwise so that, e.g., negative ints do not
+  // spill into the flag.
   template<typename TT>
   void* tag_result(std::optional<TT> result) {
+    static_assert(sizeof(TT) <= 6 || std::is_pointer<TT>::value,
+		  "tagged result must be a pointer or at most 6 bytes");
     if(!result.has_value()) return (void*) (2ul << 48);
-    else return (void*) ((1ul << 48) | (size_t) result.value());
+    size_t x = 0;
+    if constexpr (std::is_pointer<TT>::value) x = (size_t) result.value();
+    else std::memcpy(&x, &(*result), sizeof(TT));
+    return (void*) ((1ul << 48) | x);
   }
 
   std::optional<size_t> extract_result(T* p) {
@@ -278,5 +419,44 @@ bool skip_if_done_no_log(F f) { return internal::skip_if_done_no_log(f); }
 template <typename F>
 void non_idempotent(F f) { internal::with_empty_log(f); }
 
+// The following reduce the number of log entries used in a lock.
+
+// Runs read only code f without logging its loads, and commits just
+// the result (at most 6 bytes) to a single log entry.
+template <typename V, typename F>
+V read_only(F f) { return internal::read_only<V>(f); }
+
+// Runs f once among all helpers using a single log entry, e.g. to
+// retire several objects.  f is run with an empty log.
+template <typename F>
+void run_once(F f) {
+  if (internal::lg.commit_value((void*) 1).second)
+    internal::with_empty_log(f);
+}
+
+// Loads several small atomics (e.g. flags, counts and bytes) and
+// commits their values together in a single log entry rather than one
+// entry each.  Their sizes can total at most 6 bytes.
+// Returns a tuple of the values.
+template <typename ... Atomics>
+auto load_all(Atomics& ... as) {
+  auto vals = std::make_tuple(as.load_ni()...);
+  static_assert((sizeof(as.load_ni()) + ...) <= 6,
+		"values for load_all must fit in 6 bytes");
+  if (internal::lg.is_empty()) return vals;
+  size_t packed = 0;
+  char* bytes = (char*) &packed;
+  int offset = 0;
+  std::apply([&] (auto& ... v) {
+      ((memcpy(bytes + offset, &v, sizeof(v)), offset += sizeof(v)), ...);},
+    vals);
+  packed = internal::lg.commit_value_safe(packed).first;
+  offset = 0;
+  std::apply([&] (auto& ... v) {
+      ((memcpy(&v, bytes + offset, sizeof(v)), offset += sizeof(v)), ...);},
+    vals);
+  return vals;
+}
+
 } // namespace flck
 
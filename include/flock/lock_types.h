@@ -1,5 +1,6 @@
 #pragma once
 #include <atomic>
+#include <tuple>
 #include "epoch.h"
 #include "no_tagged.h"
 
@@ -9,16 +10,18 @@ template <typename V>
 struct atomic {
 private:
   std::atomic<V> v;
+  V load_protected() {
+    return internal::protect_read<V>([&] {return v.load();});}
 public:
-  static_assert(sizeof(V) <= 4 || std::is_pointer<V>::value,
-    "Type for mutable must be a pointer or at most 4 bytes");
+  static_assert(sizeof(V) <= 4 || sizeof(V) == 8 || std::is_pointer<V>::value,
+    "Type for mutable must be a pointer, at most 4 bytes or 8 bytes");
   atomic(V v) : v(v) {}
   atomic() : v(0) {}
   void init(V vv) {v = vv;}
-  V load() {return v.load();}
-  V read() {return v.load();}
-  V read_snapshot() {return v.load();}
-  V read_cur() {return v.load();}
+  V load() {return load_protected();}
+  V read() {return load_protected();}
+  V read_snapshot() {return load_protected();}
+  V read_cur() {return load_protected();}
   void store(V vv) { v = vv;}
   bool cas(V old_v, V new_v) {
     return (v.load() == old_v &&
@@ -42,9 +45,11 @@ struct atomic_write_once {
   std::atomic<V> v;
   atomic_write_once(V initial) : v(initial) {}
   atomic_write_once() {}
-  V load() {return v.load();}
-  V load_ni() {return v.load();}
-  V read() {return v.load();}
+  V load_protected() {
+    return internal::protect_read<V>([&] {return v.load();});}
+  V load() {return load_protected();}
+  V load_ni() {return load_protected();}
+  V read() {return load_protected();}
   void init(V vv) { v = vv; }
   void store(V vv) { v = vv; }
   bool cas_ni(V exp_v, V new_v) {return v.compare_exchange_strong(exp_v, new_v);}
@@ -52,8 +57,8 @@ struct atomic_write_once {
   // inline operator V() { return load(); } // implicit conversion
 };
 
-template <typename T>
-using memory_pool = internal::mem_pool<T>;
+template <typename T, typename Pool=internal::default_pool<T>>
+using memory_pool = Pool;
 
   // to make consistent with lock free implementation
   namespace internal {
@@ -73,5 +78,14 @@ using memory_pool = internal::mem_pool<T>;
   template <typename F>
   void non_idempotent(F f) { f();}
 
+  template <typename V, typename F>
+  V read_only(F f) { return f();}
+
+  template <typename F>
+  void run_once(F f) { f();}
+
+  template <typename ... Atomics>
+  auto load_all(Atomics& ... as) { return std::make_tuple(as.load()...);}
+
 } // namespace flck
 
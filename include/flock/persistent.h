@@ -0,0 +1,155 @@
+#pragma once
+#include <atomic>
+#include <limits>
+
+// ***************************
+// persistent (multiversioned) pointers
+// ***************************
+
+// A pointer that keeps its earlier values in a version chain so that
+// a snapshot can read the value it had when the snapshot was taken.
+// Based on:
+//   Wei, Ben-David, Blelloch, Fatourou, Rupert and Sun,
+//   Constant-Time Snapshots with Applications to Concurrent Data Structures
+//   PPoPP 2021
+// Each store adds a version link with the new value to the front of
+// the chain.  Links are given a timestamp lazily, by whoever first
+// sees them, from a global timestamp that is incremented by each
+// snapshot.  A snapshot with timestamp ts reads the first value in the
+// chain with a stamp of at most ts.
+//
+// A value written with init (i.e. before the object is shared) is
+// kept directly in the pointer, tagged in its low bit, rather than in
+// a link, so copying a node does not allocate any links.
+//
+// A store stamps its new link before retiring the old one, and does
+// both inside the epoch of the writer.  Any snapshot that still needs
+// the old link therefore started before it was retired, so version
+// chains are reclaimed by the epoch based pool with no extra work.
+// This argument does not hold for interval based reclamation, which
+// only protects what a thread has loaded itself.
+
+#ifdef IBR
+#error "persistent pointers (snapshots) are not supported with IBR"
+#endif
+
+namespace flck {
+namespace internal {
+
+struct alignas(64) timestamp_s {
+  static constexpr long tbd = std::numeric_limits<long>::max();
+  std::atomic<long> stamp;
+  timestamp_s() : stamp(1) {}
+
+  long get_write_stamp() { return stamp.load(); }
+
+  // Stores stamped after this returns get a larger stamp.  If the
+  // increment fails another snapshot has already done it.
+  long get_read_stamp() {
+    long ts = stamp.load();
+    stamp.compare_exchange_strong(ts, ts+1);
+    return ts;
+  }
+};
+
+timestamp_s global_stamp;
+
+// timestamp of the snapshot the thread is in, -1 if not in one
+static thread_local long local_stamp = -1;
+
+} // end namespace internal
+
+template <typename T>
+struct persistent_ptr {
+private:
+  struct version_link {
+    std::atomic<long> stamp;
+    T* value;
+    version_link* next; // the previous version (can be direct)
+    version_link(T* value, version_link* next)
+      : stamp(internal::timestamp_s::tbd), value(value), next(next) {}
+  };
+
+  static bool is_direct(version_link* l) { return ((size_t) l) & 1ul;}
+  static version_link* direct(T* p) {
+    return (version_link*) (((size_t) p) | 1ul);}
+  static T* strip(version_link* l) { return (T*) (((size_t) l) & ~1ul);}
+
+  static memory_pool<version_link>& link_pool() {
+    static memory_pool<version_link> pool;
+    return pool;
+  }
+
+  // idempotent, so can be run by helpers
+  static void set_stamp(version_link* l) {
+    if (!is_direct(l) && l->stamp.load() == internal::timestamp_s::tbd) {
+      long tbd = internal::timestamp_s::tbd;
+      l->stamp.compare_exchange_strong(tbd,
+	  internal::global_stamp.get_write_stamp());
+    }
+  }
+
+  static T* value_of(version_link* l) {
+    set_stamp(l);
+    return is_direct(l) ? strip(l) : l->value;
+  }
+
+  atomic<version_link*> v;
+
+public:
+  persistent_ptr(T* p) : v(direct(p)) {}
+  persistent_ptr() : v(direct(nullptr)) {}
+
+  // the object holding the pointer is no longer reachable so its
+  // current link is not either (older links are already retired)
+  ~persistent_ptr() {
+    version_link* l = v.read();
+    if (!is_direct(l)) link_pool().destruct(l);
+  }
+
+  void init(T* p) { v.init(direct(p)); }
+  T* load() { return value_of(v.load()); }
+  T* read() { return value_of(v.read()); }
+
+  // the value at the time of the enclosing snapshot, or the current
+  // value if not in a snapshot
+  T* read_snapshot() {
+    long ts = internal::local_stamp;
+    version_link* l = v.read();
+    set_stamp(l);
+    if (ts == -1) return is_direct(l) ? strip(l) : l->value;
+    while (!is_direct(l) && l->stamp.load() > ts) l = l->next;
+    return is_direct(l) ? strip(l) : l->value;
+  }
+
+  void store(T* p) {
+    version_link* old = v.load();
+    version_link* new_l = link_pool().new_obj(p, old);
+    v = new_l;
+    set_stamp(new_l);
+    if (!is_direct(old)) link_pool().retire(old);
+  }
+
+  T* operator=(T* p) { store(p); return p; }
+
+  // makes sure the current value has a timestamp
+  void validate() { set_stamp(v.read()); }
+};
+
+// Runs f with the thread reading persistent pointers at a snapshot
+// taken at its start (see read_snapshot).
+template <typename F>
+auto with_snapshot(F f) {
+  return with_epoch([&] {
+    internal::local_stamp = internal::global_stamp.get_read_stamp();
+    if constexpr (std::is_void_v<std::invoke_result_t<F>>) {
+      f();
+      internal::local_stamp = -1;
+    } else {
+      auto r = f();
+      internal::local_stamp = -1;
+      return r;
+    }});
+}
+
+} // end namespace flck
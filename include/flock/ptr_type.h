@@ -1,39 +1,30 @@
-// This selects between using persistent objects or regular objects
-// Persistent objects are implemented as described in:
-//   Wei, Ben-David, Blelloch, Fatourou, Rupert and Sun,
-//   Constant-Time Snapshots with Applications to Concurrent Data Structures
-//   PPoPP 2021
-// They support snapshotting via version chains, and without
-// indirection, but pointers to objects (ptr_type) must be "recorded
-// once" as described in the paper.
+#pragma once
+
+// This selects between using persistent pointers or regular atomic
+// pointers for the pointers a structure follows in a range query.
+// Persistent pointers support snapshotting via version chains (see
+// persistent.h) so that range queries run in with_snap are atomic.
+
+namespace flck {
 
 // persistent objects, ptr_type includes version chains
 #ifdef Persistent
-// #ifdef noABA
-// #include "persistent_noaba.h"
-// #else
-// #include "persistent.h"
-// #endif
-// using ll_head = persistent;
 
-// template <typename T>
-// using ptr_type = persistent_ptr<T>;
+template <typename T>
+using ptr_type = persistent_ptr<T>;
 
-// template <typename F>
-// auto with_snap(F f) { return with_snapshot(f);};
+template <typename F>
+auto with_snap(F f) { return with_snapshot(f);}
 
 // normal non-persistent type
 #else
-struct ll_head {};
+
+template <typename T>
+using ptr_type = atomic<T*>;
 
 template <typename F>
-auto with_snap(F f) { return with_epoch(f);};
+auto with_snap(F f) { return with_epoch(f);}
 
-#ifdef LongPtr
-template <typename T>
-using ptr_type = mutable_double<T*>;
-#else
-template <typename T>
-using ptr_type = mutable_val<T*>;
-#endif
 #endif
+
+} // namespace flck
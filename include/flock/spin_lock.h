@@ -3,6 +3,9 @@
 //   with_lock(thunk_returning_val) -> val
 //   try_lock(thunk_returning_boolean) -> boolean
 //   try_lock_result(thunk_returning_val) -> optional<val>
+//   with_validated_read(thunk_returning_val) -> val
+//   try_validated_read(thunk_returning_boolean) -> boolean
+//   try_validated_read_result(thunk_returning_val) -> optional<val>
 //   wait_lock() -> void
 //   is_locked() -> bool
 
@@ -12,6 +15,8 @@
 #include<chrono>
 #include<thread>
 #include<optional>
+#include "stall.h"
+#include "backoff.h"
 
 namespace flck {
   namespace internal {
@@ -65,6 +70,7 @@ public:
     if (!current.is_locked()) { // unlocked
       lock_entry newl = current.take_lock();
       if (lck.compare_exchange_strong(current, newl)) {
+	maybe_stall();
 	RT result = f();
 	lck = newl.release_lock();  // release lock
 	return std::optional<RT>(result); 
@@ -92,23 +98,53 @@ public:
       std::cout << "self lock using with_lock not supported" << std::endl;
       abort();
     }
-    const int init_delay = 100;
-    const int max_delay = 2000;
-    int delay = init_delay;
-
+    exponential_backoff<100, 2000> b;
     while (true) {
       lock_entry newl = current.take_lock();
       if (!current.is_locked() &&
 	  lck.compare_exchange_strong(current, newl)) {
+	maybe_stall();
 	RT result = f();
 	lck = newl.release_lock();
 	return result;
       }
-      for (volatile int i=0; i < delay; i++);
-      delay = std::min(2*delay, max_delay);
+      b.wait();
+      current = lck.load();
     }
   }
 
+  // Validated read, as in lf_lock.h.  Runs f without taking the lock
+  // and keeps its result only if no thread held the lock at any time
+  // during f, which holds if the lock entry is free before f and
+  // unchanged after it (the count changes on every acquisition).
+  template <typename Thunk>
+  auto try_validated_read_result(Thunk f) {
+    using RT = decltype(f());
+    static_assert(sizeof(RT) <= 4 || std::is_pointer<RT>::value,
+		  "Result of try_validated_read must be a pointer or at most 4 bytes");
+    lock_entry current = lck.load();
+    if (current.is_self_locked()) return std::optional<RT>(f());
+    if (current.is_locked()) return std::optional<RT>(); // fail
+    RT result = f();
+    if (lck.load().le != current.le) return std::optional<RT>(); // fail
+    return std::optional<RT>(result);
+  }
+
+  template <typename Thunk>
+  auto try_validated_read(Thunk f) {
+    auto result = try_validated_read_result(f);
+    return result.has_value() && result.value();
+  }
+
+  template <typename Thunk>
+  auto with_validated_read(Thunk f) {
+    exponential_backoff<100, 2000> b;
+    while (true) {
+      auto result = try_validated_read_result(f);
+      if (result.has_value()) return result.value();
+      b.wait();
+    }
+  }
 };
   } // namespace  internal
 } //namespace flck
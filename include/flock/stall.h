@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <sched.h>
+#include <parlay/utilities.h>
+
+// ***************************
+// stall injection
+// ***************************
+
+// A debugging and benchmarking hook that simulates the owner of a
+// lock being descheduled inside its critical section.  When compiled
+// with InjectStalls, after inject_stalls(one_in, sleep_us) the owner
+// stalls with probability 1/one_in right after acquiring a lock,
+// either yielding (sleep_us = 0) or sleeping for sleep_us
+// microseconds.  With lock free locks other threads can help the
+// stalled owner finish, while with NoHelp they have to wait for it.
+
+namespace flck {
+namespace internal {
+
+struct stall_injection_s {
+  std::atomic<long> one_in;
+  std::atomic<long> sleep_us;
+  stall_injection_s() : one_in(0), sleep_us(0) {}
+};
+
+stall_injection_s stall_injection;
+
+// called by the owner of a lock after acquiring it
+inline void maybe_stall() {
+#ifdef InjectStalls
+  long n = stall_injection.one_in.load(std::memory_order_relaxed);
+  if (n == 0) return;
+  static thread_local size_t count = ((size_t) parlay::worker_id()) << 40;
+  if (parlay::hash64(++count) % n != 0) return;
+  long us = stall_injection.sleep_us.load(std::memory_order_relaxed);
+  if (us == 0) sched_yield();
+  else std::this_thread::sleep_for(std::chrono::microseconds(us));
+#endif
+}
+
+} // namespace internal
+
+// stall in one in one_in lock acquisitions (0 to stop)
+inline void inject_stalls(long one_in, long sleep_us = 0) {
+  internal::stall_injection.one_in = one_in;
+  internal::stall_injection.sleep_us = sleep_us;
+}
+
+} // namespace flck
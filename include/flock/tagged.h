@@ -132,6 +132,23 @@ public:
     return cas_tagged_(loc, oldv, newv, aba_free);
   }
 
+  // As cas, but for a CAS that each helper can retry a different number
+  // of times, so it cannot take a new log entry per attempt.  All
+  // attempts share the entry succeeded, which is only marked by a
+  // successful attempt, after which every attempt is skipped and
+  // reports success.  A null entry means not in a log.
+  static bool cas_until_success(std::atomic<IT> &loc, IT oldv, V v,
+				log_entry* succeeded) {
+    if (succeeded == nullptr) return cas(loc, oldv, v);
+    if (succeeded->load() != nullptr) return true;
+    IT newv = next(oldv, v, (IT) &loc);
+    announce_write.set(add_tag(oldv, (IT) &loc));
+    bool r = loc.compare_exchange_strong(oldv, newv);
+    announce_write.clear();
+    if (r) succeeded->store((void*) 1, std::memory_order::memory_order_release);
+    return r;
+  }
+
   // a safe cas that assigns the new value a tag that no concurrent cas
   // on the same location has in its old value
   static bool cas_with_same_tag(std::atomic<IT> &loc, IT oldv, V v, bool aba_free=false) {
@@ -0,0 +1,54 @@
+#pragma once
+#include <optional>
+#include <utility>
+
+// Operations that change the value of a key in place, derived from a
+// structure's single primitive
+//
+//   std::optional<V> upsert_f(root, k, f)
+//
+// which, atomically, sets the value v of k to f(v) if present, and
+// otherwise inserts k with value f({}).  Nothing is changed if f
+// returns {}.  It returns the old value, if any.  f should not have
+// side effects since it can be called more than once, on a retry or by
+// a helper.  A set gets the rest by deriving from upsert_ops, as in:
+//
+//   struct Set : flck::upsert_ops<Set<K,V>, K, V> { ... upsert_f ... };
+//
+// The root is passed along unchanged, so it can be a node* or a
+// reference to a table.
+
+namespace flck {
+
+template <typename Set, typename K, typename V>
+struct upsert_ops {
+  // inserts k with value v, or sets its value to v if present
+  // returns true if k was inserted
+  template <typename Root>
+  bool upsert(Root&& root, K k, V v) {
+    return !self()->upsert_f(std::forward<Root>(root), k, [=] (std::optional<V>) {
+	return std::optional<V>(v);}).has_value();
+  }
+
+  // sets the value v of k to g(v) if present, returning the old value
+  template <typename Root, typename G>
+  std::optional<V> update(Root&& root, K k, G g) {
+    return self()->upsert_f(std::forward<Root>(root), k,
+			    [=] (std::optional<V> v) -> std::optional<V> {
+	if (v.has_value()) return g(*v);
+	else return {};});
+  }
+
+  // adds delta to the value of k, inserting it with value delta if not
+  // present, and returns the old value (V() if not present)
+  template <typename Root>
+  V fetch_add(Root&& root, K k, V delta) {
+    return self()->upsert_f(std::forward<Root>(root), k, [=] (std::optional<V> v) {
+	return std::optional<V>(v.value_or(V()) + delta);}).value_or(V());
+  }
+
+private:
+  Set* self() {return static_cast<Set*>(this);}
+};
+
+} // namespace flck
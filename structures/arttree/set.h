@@ -1,17 +1,53 @@
 #include <flock/flock.h>
 #include <parlay/primitives.h>
+#include <limits>
+#include <string>
+#include <type_traits>
 #define Range_Search 1
+#define Multi_Find 1
+#define Bulk_Build 1
+#define Upsert 1
 
-template <typename K, typename V>
-struct Set {
+template <typename K, typename V, typename Backoff = flck::retry_backoff>
+struct Set : flck::upsert_ops<Set<K, V, Backoff>, K, V> {
+
+  struct KV {K key; V value;};
 
   enum node_type : char {Full, Indirect, Sparse, Leaf};
 
+  // Keys are either unsigned integers, compared a byte at a time from
+  // the most significant byte, or byte strings such as std::string,
+  // compared a character at a time.  A string key is read as if
+  // followed by a zero byte, which ends it, so string keys must not
+  // contain zero bytes.  Both orders agree with K's operator<.
+  static constexpr bool integer_keys = std::is_integral_v<K>;
+
   // extracts byte from key at position pos
-  // assumes little endian, and currently specific to integer types
-  // need to generalize to character or byte strings
-  static int get_byte(K key, int pos) {
-    return (key >> (8*(sizeof(K)-1-pos))) & 255;
+  static int get_byte(const K& key, int pos) {
+    if constexpr (integer_keys)
+      return (key >> (8*(sizeof(K)-1-pos))) & 255;
+    else return ((size_t) pos < key.size()) ? (unsigned char) key[pos] : 0;
+  }
+
+  // the byte_num of a leaf, one past the last byte of its key
+  static int key_length(const K& key) {
+    if constexpr (integer_keys) return sizeof(K);
+    else return key.size() + 1;
+  }
+
+  // A string key must have a key_length that fits in byte_num (a
+  // short), and must not contain zero bytes since one ends the key.
+  static bool valid_key(const K& key) {
+    if constexpr (integer_keys) return true;
+    else return (key.size() < std::numeric_limits<short int>::max()
+		 && key.find('\0') == K::npos);
+  }
+
+  // An internal node only ever compares the bytes before its
+  // byte_num, so string keys are cut down to that prefix.
+  static K key_prefix(const K& key, int byte_num) {
+    if constexpr (integer_keys) return key;
+    else return key.substr(0, byte_num);
   }
 
   struct header {
@@ -22,13 +58,13 @@ struct Set {
     // e.g. the root has byte_num = 0
     short int byte_num; 
     header(node_type nt) : nt(nt), removed(false) {}
-    header(K key, node_type nt, int byte_num)
+    header(const K& key, node_type nt, int byte_num)
       : key(key), nt(nt), removed(false), byte_num((short int) byte_num) {}
   };
 
   // generic node
   struct node : header, flck::lock {};
-  using node_ptr = flck::atomic<node*>;
+  using node_ptr = flck::ptr_type<node>;
 
   // 256 entries, one for each value of a byte, null if empty
   struct full_node : header, flck::lock {
@@ -36,11 +72,11 @@ struct Set {
 
     bool is_full() {return false;}
 
-    node_ptr* get_child(K k) {
+    node_ptr* get_child(const K& k) {
       auto b = get_byte(k, header::byte_num);
       return &children[b];}
 
-    void init_child(int k, node* c) {
+    void init_child(const K& k, node* c) {
       auto b = get_byte(k, header::byte_num);
       children[b].init(c);
     }
@@ -55,7 +91,7 @@ struct Set {
   // entries.  A new slot can only be added, but when the key is
   // deleted its entry in the 64-pointer array is made null and
   // can be refilled.  Once all 64 slots are used a new node
-  // has to be allocated.
+  // has to be allocated, which only copies the non-null entries.
   struct indirect_node : header, flck::lock {
     flck::atomic<int> num_used; // could be aba_free since only increases
     flck::atomic_write_once<char> idx[256];  // -1 means empty
@@ -63,20 +99,20 @@ struct Set {
 
     bool is_full() {return num_used.load() == 64;}
     
-    node_ptr* get_child(K k) {
+    node_ptr* get_child(const K& k) {
       int i = idx[get_byte(k, header::byte_num)].load();
       if (i == -1) return nullptr;
       else return &ptr[i];}
 
-    // Requires that node is not full (i.e. num_used < 64)
-    void add_child(K k, node* v) {
-      int i = num_used.load();
+    // Requires that node is not full (i.e. num_used < 64), and that
+    // i is the current value of num_used
+    void add_child(const K& k, int i, node* v) {
       idx[get_byte(k, header::byte_num)] = i;
       ptr[i] = v;
       num_used = i+1;
     }
 
-    void init_child(K k, node* c) {
+    void init_child(const K& k, node* c) {
       int i = num_used.load()-1;
       idx[get_byte(k, header::byte_num)] = i;
       ptr[i].init(c);
@@ -99,7 +135,7 @@ struct Set {
 
     bool is_full() {return num_used == 16;}
 
-    node_ptr* get_child(K k) {
+    node_ptr* get_child(const K& k) {
       __builtin_prefetch (((char*) ptr) + 64);
       int kb = get_byte(k, header::byte_num);
       for (int i=0; i < num_used; i++) 
@@ -107,15 +143,15 @@ struct Set {
       return nullptr;
     }
 
-    void init_child(K k, node* c) {
+    void init_child(const K& k, node* c) {
       int kb = get_byte(k, header::byte_num);
       keys[num_used-1] = kb;
       ptr[num_used-1].init(c);
     }
 
     // constructor for a new sparse node with two children
-    sparse_node(int byte_num, node* v1, K k1, node* v2, K k2)
-      : header(k1, Sparse, byte_num), num_used(2) {
+    sparse_node(int byte_num, node* v1, const K& k1, node* v2, const K& k2)
+      : header(key_prefix(k1, byte_num), Sparse, byte_num), num_used(2) {
       keys[0] = get_byte(k1, byte_num);
       ptr[0].init(v1);
       keys[1] = get_byte(k2, byte_num);
@@ -128,7 +164,8 @@ struct Set {
 
   struct leaf : header {
     V value;
-    leaf(K key, V value) : header(key, Leaf, sizeof(K)), value(value) {};
+    leaf(const K& key, V value)
+      : header(key, Leaf, key_length(key)), value(value) {};
   };
 
   flck::memory_pool<full_node> full_pool;
@@ -138,7 +175,7 @@ struct Set {
 
   // dispatch based on node type
   // A returned nullptr means no child matching the key
-  inline node_ptr* get_child(node* x, K k) {
+  inline node_ptr* get_child(node* x, const K& k) {
     switch (x->nt) {
     case Full : return ((full_node*) x)->get_child(k);
     case Indirect : return ((indirect_node*) x)->get_child(k);
@@ -157,22 +194,145 @@ struct Set {
     return false;
   }
 
+  // applies f(b, c) to each non-null child c of p, where b is its byte
+  template <typename F>
+  void for_each_child(node* p, F f) {
+    switch (p->nt) {
+    case Full : {
+      auto f_n = (full_node*) p;
+      for (int b=0; b < 256; b++) {
+	node* c = f_n->children[b].load();
+	if (c != nullptr) f(b, c);
+      }
+      return;
+    }
+    case Indirect : {
+      auto i_n = (indirect_node*) p;
+      for (int b=0; b < 256; b++) {
+	int j = i_n->idx[b].load();
+	if (j == -1) continue;
+	node* c = i_n->ptr[j].load();
+	if (c != nullptr) f(b, c);
+      }
+      return;
+    }
+    case Sparse : {
+      auto s_n = (sparse_node*) p;
+      for (int i=0; i < s_n->num_used; i++) {
+	node* c = s_n->ptr[i].load();
+	if (c != nullptr) f(s_n->keys[i], c);
+      }
+      return;
+    }
+    case Leaf : return;
+    }
+  }
+
+  // number of non-null children of p other than skip
+  int num_children(node* p, node* skip) {
+    int cnt = 0;
+    for_each_child(p, [&] (int b, node* c) {if (c != skip) cnt++;});
+    return cnt;
+  }
+
+  // A remove shrinks a full node to an indirect (or sparse) node once
+  // it is left with at most full_shrink children, and an indirect node
+  // to a sparse node at indirect_shrink.  These are well below the
+  // sizes at which nodes grow so that a node does not flip back and
+  // forth between kinds.
+  static constexpr int full_shrink = 32;
+  static constexpr int indirect_shrink = 8;
+
+  // true if removing child c from p would leave p small enough to
+  // shrink.  Reads the children without the lock, stopping early once
+  // there are too many, so it is only a hint.  Since counting the
+  // children of a full node can read all 256 pointers, it is only done
+  // for one in full_check_rate removes (picked by the leaf's address),
+  // so a full node shrinks a few removes after it could have.
+  static constexpr int full_check_rate = 8;
+  bool should_shrink(node* p, node* c) {
+    int limit;
+    if (p->nt == Full) {
+      if (parlay::hash64((size_t) c) % full_check_rate != 0) return false;
+      limit = full_shrink;
+    } else if (p->nt == Indirect) limit = indirect_shrink;
+    else return false;
+    int cnt = 0;
+    node_ptr* ptrs;
+    int n;
+    if (p->nt == Full) {ptrs = ((full_node*) p)->children; n = 256;}
+    else {ptrs = ((indirect_node*) p)->ptr; n = ((indirect_node*) p)->num_used.load();}
+    for (int i=0; i < n; i++) {
+      node* x = ptrs[i].load();
+      if (x != nullptr && x != c && ++cnt > limit) return false;
+    }
+    return true;
+  }
+
+  // Returns a copy of p, without its child skip (if not null) and with
+  // the new child add at byte add_b (if not null), as the smallest kind
+  // of node that holds its cnt children.  Children of p that are null
+  // are dropped, which compacts sparse nodes and frees the slots of an
+  // indirect node.  p needs to be locked.
+  node* copy_node(node* p, int cnt, node* skip, node* add, int add_b) {
+    auto copy_children = [=] (auto add_child) {
+      for_each_child(p, [&] (int b, node* c) {if (c != skip) add_child(b, c);});
+      if (add != nullptr) add_child(add_b, add);};
+    if (cnt <= 16)
+      return (node*) sparse_pool.new_init([=] (sparse_node* s_n) {
+	  s_n->key = p->key;
+	  s_n->byte_num = p->byte_num;
+	  copy_children([&] (int b, node* c) {
+	      s_n->keys[s_n->num_used] = b;
+	      s_n->ptr[s_n->num_used++].init(c);});});
+    else if (cnt <= 64)
+      return (node*) indirect_pool.new_init([=] (indirect_node* i_n) {
+	  i_n->key = p->key;
+	  i_n->byte_num = p->byte_num;
+	  int j = 0;
+	  copy_children([&] (int b, node* c) {
+	      i_n->idx[b].init(j);
+	      i_n->ptr[j++].init(c);});
+	  i_n->num_used.init(j);});
+    else
+      return (node*) full_pool.new_init([=] (full_node* f_n) {
+	  f_n->key = p->key;
+	  f_n->byte_num = p->byte_num;
+	  copy_children([&] (int b, node* c) {
+	      f_n->children[b].init(c);});});
+  }
+
+  // retires p but not its children
+  void retire_node(node* p) {
+    switch (p->nt) {
+    case Full : full_pool.retire((full_node*) p); return;
+    case Indirect : indirect_pool.retire((indirect_node*) p); return;
+    case Sparse : sparse_pool.retire((sparse_node*) p); return;
+    case Leaf : leaf_pool.retire((leaf*) p); return;
+    }
+  }
+
   // Adds a new child to p with key k and value v
   // gp is p's parent (i.e. grandparent)
   // This might involve copying p either because
   //   p is sparse (can only be copied), or because
   //   p is indirect but full
-  // If p is copied, then gp is updated to point to the new one
+  // If p is copied, then gp is updated to point to the new one, which
+  // is of the smallest kind that holds the children.
   // This should never be called on a full node.
   // Returns false if it fails.
   bool add_child(node* gp, node* p, K k, V v) {
     if (p->nt == Indirect && !is_full(p)) {
       // If non-full indirect node try to add a child pointer
+      indirect_node* i_n = (indirect_node*) p;
       return p->try_lock([=] {
-          if (p->removed.load() || is_full(p) ||
-	      get_child(p, k) != nullptr) return false;
+	  // check not removed, not full, and no child, all in one log entry
+	  int b = get_byte(k, i_n->byte_num);
+	  auto [removed, num_used, idx] =
+	    flck::load_all(i_n->removed, i_n->num_used, i_n->idx[b]);
+	  if (removed || num_used == 64 || idx != -1) return false;
 	  node* c = (node*) leaf_pool.new_obj(k, v);
-	  ((indirect_node*) p)->add_child(k, c);
+	  i_n->add_child(k, num_used, c);
 	  return true;
 	});
     } else {
@@ -183,59 +343,13 @@ struct Set {
 	    return false;
 	  return p->try_lock([=] {
               if (get_child(p,k) != nullptr) return false;
+	      int cnt = flck::read_only<int>([=] {
+		  return num_children(p, nullptr);});
 	      node* c = (node*) leaf_pool.new_obj(k, v);
-	      if (p->nt == Indirect) {
-		indirect_node* i_n = (indirect_node*) p;
-		i_n->removed = true; 
-
-		// copy indirect to full
-		*child_ptr = (node*) full_pool.new_init([=] (full_node* f_n) {
- 		  f_n->key = i_n->key;
-		  f_n->byte_num = i_n->byte_num;
-		  for (int i=0; i < 256; i++) {
-		    int j = i_n->idx[i].load();
-		    if (j != -1) f_n->children[i].init(i_n->ptr[j].load());
-		  }
-
-		  // seemingly broken g++ (10.3) compiler makes the following fail
-		  //   f_n->init_child(k, c);
-		  // inlining by hand fixes it.
-		  auto b = get_byte(k, f_n->byte_num);
-		  f_n->children[b].init(c);
-		});
-		indirect_pool.retire(i_n);
-	      } else { // (p->nt == Sparse)
-		sparse_node* s_n = (sparse_node*) p;
-		s_n->removed = true;
-		if (is_full(p)) {
-
-		  // copy sparse to indirect
-		  *child_ptr = (node*) indirect_pool.new_init([=] (indirect_node* i_n) {
-  		    i_n->key = s_n->key;
-		    i_n->byte_num = s_n->byte_num;
-		    i_n->num_used.init(16 + 1);
-		    for (int i=0; i < 16; i++) {
-		      i_n->idx[s_n->keys[i]].init(i);
-		      i_n->ptr[i].init(s_n->ptr[i].load());
-		    }
-		    i_n->init_child(k, c);
-	          });  
-		} else {
-
-		  // copy sparse to sparse
-		  *child_ptr = (node*) sparse_pool.new_init([=] (sparse_node* s_c) {
-  		    s_c->key = s_n->key;
-		    s_c->byte_num = s_n->byte_num;
-		    s_c->num_used = s_n->num_used + 1;
-		    for (int i=0; i < s_n->num_used; i++) {
-		      s_c->keys[i] = s_n->keys[i];
-		      s_c->ptr[i].init(s_n->ptr[i].load());
-		    }
-		    s_c->init_child(k, c);
-	          });
-		}
-		sparse_pool.retire(s_n);
-	      }
+	      p->removed = true;
+	      *child_ptr = copy_node(p, cnt + 1, nullptr, c,
+				     get_byte(k, p->byte_num));
+	      retire_node(p);
 	      return true;
 	    }); // end try_lock(p->lck
 	  return true;
@@ -243,7 +357,7 @@ struct Set {
     } // end else
   }
 
-  auto find_location(node* root, K k) {
+  auto find_location(node* root, const K& k) {
     int byte_pos = 0;
     node* gp = nullptr;
     node* p = root;
@@ -266,8 +380,11 @@ struct Set {
     }
   }
 
-  bool insert(node* root, K k, V v) {
-    return flck::with_epoch([=] {
+  // returns false and does no update if already in tree
+  // needs to be run in an epoch
+  bool insert_(node* root, K k, V v) {
+      assert(valid_key(k));
+      Backoff b;
       while (true) {		 
 	auto [gp, p, cptr, c, byte_pos] = find_location(root, k);
 	if (c != nullptr && c->nt == Leaf && c->byte_num == byte_pos)
@@ -294,9 +411,42 @@ struct Set {
 	} else { // no child pointer, need to add
 	  if (add_child(gp, p, k, v)) return true;
 	}
+	b.wait();
       } // end while
       return true; // should never get here
-    });
+  }
+
+  bool insert(node* root, K k, V v) {
+    return flck::with_epoch([=] {return insert_(root, k, v);});
+  }
+
+  // upsert_f for flck::upsert_ops.  A present key gets a new leaf
+  // under the parent's lock, and a missing one goes through insert_.
+  template <typename F>
+  std::optional<V> upsert_f(node* root, K k, F f) {
+    return flck::with_epoch([=] () -> std::optional<V> {
+      Backoff b;
+      while (true) {
+	auto [gp, p, cptr, c, byte_pos] = find_location(root, k);
+	if (is_leaf_for(c, byte_pos)) {
+	  V old = ((leaf*) c)->value;
+	  std::optional<V> new_v = f(std::optional<V>(old));
+	  if (!new_v.has_value()) return old;
+	  V v = *new_v;
+	  if (p->try_lock([=] {
+		if (p->removed.load() || cptr->load() != c) return false;
+		*cptr = (node*) leaf_pool.new_obj(k, v);
+		leaf_pool.retire((leaf*) c);
+		return true;}))
+	    return old;
+	  b.wait();
+	} else {
+	  std::optional<V> new_v = f(std::optional<V>());
+	  if (!new_v.has_value()) return {};
+	  // fails if k was inserted since, in which case try again
+	  if (insert_(root, k, *new_v)) return {};
+	}
+      }});
   }
 
   // returns other child if node is sparse and has two children, one
@@ -314,20 +464,27 @@ struct Set {
     return result;
   }
 				 
-  // currently a "lazy" remove that only removes
-  //   1) the leaf
-  //   2) its parent if it is sparse with just two children
+  // Removes the leaf, and also
+  //   1) its parent if it is sparse with just two children, or
+  //   2) shrinks its parent if it is full or indirect and is left with
+  //      few children, replacing it with a copy of a smaller kind
   bool remove(node* root, K k) {
     return flck::with_epoch([=] {
+      Backoff b;
       while (true) {
 	auto [gp, p, cptr, c, byte_pos] = find_location(root, k);
 	// if not found return
 	if (c == nullptr || !(c->nt == Leaf && c->byte_num == byte_pos))
 	  return false;
+	// decided outside the lock since it reads many children, and
+	// the root is never shrunk
+	bool shrink = gp != nullptr && should_shrink(p, c);
 	if (p->try_lock([=] {
 	    if (p->removed.load() || cptr->load() != c) return false;
 
-  	    node* other_child = single_other_child(p,c);
+	    // only the result is logged, not each child read
+	    node* other_child = flck::read_only<node*>([=] {
+		return single_other_child(p,c);});
 	    //node* other_child = nullptr;
 	    if (other_child != nullptr && gp->nt != Sparse) {
 	      // if parent will become singleton try to remove parent as well
@@ -337,8 +494,29 @@ struct Set {
 		    return false;
 		  *child_ptr = other_child;
 		  p->removed = true;
-		  sparse_pool.retire((sparse_node*) p);
-		  leaf_pool.retire((leaf*) c);
+		  flck::run_once([=] {
+		    sparse_pool.retire((sparse_node*) p);
+		    leaf_pool.retire((leaf*) c);});
+		  return true;});
+	    }
+	    int cnt = shrink ? flck::read_only<int>([=] {
+		return num_children(p, c);}) : 0;
+	    if (shrink && cnt <= (p->nt == Full ? full_shrink : indirect_shrink)) {
+	      // replace the parent with a smaller copy without the leaf
+	      return gp->try_lock([=] {
+		  auto child_ptr = get_child(gp, p->key);
+		  if (gp->removed.load() || child_ptr->load() != p)
+		    return false;
+		  // with at most one child left p is dropped, not copied
+		  if (cnt > 1) *child_ptr = copy_node(p, cnt, c, nullptr, 0);
+		  else *child_ptr = flck::read_only<node*>([=] {
+		      node* other = nullptr;
+		      for_each_child(p, [&] (int b, node* x) {if (x != c) other = x;});
+		      return other;});
+		  p->removed = true;
+		  flck::run_once([=] {
+		    retire_node(p);
+		    leaf_pool.retire((leaf*) c);});
 		  return true;});
 	    } else { // just remove child
 	      *cptr = nullptr; 
@@ -346,16 +524,22 @@ struct Set {
 	      return true;
 	    }}))
 	  return true;
+	b.wait();
       }
       // try again
     });
   }
 
-  std::optional<V> find_(node* root, K k) {
+  // find_location can stop at a node whose prefix differs from k, or
+  // at a leaf with a different key
+  static bool is_leaf_for(node* l, int byte_pos) {
+    return l != nullptr && l->nt == Leaf && l->byte_num == byte_pos;
+  }
+
+  std::optional<V> find_(node* root, const K& k) {
     auto [gp, p, cptr, l, pos] = find_location(root, k);
     if (cptr != nullptr) cptr->validate();
-    auto ll = (leaf*) l;
-    if (ll != nullptr) return std::optional<V>(ll->value); 
+    if (is_leaf_for(l, pos)) return std::optional<V>(((leaf*) l)->value);
     else return {};
   }
 
@@ -363,30 +547,87 @@ struct Set {
     return flck::with_epoch([&] {return find_(root, k);});
   }
 
+  // Interleaved lookups (see flck::multi_find_width).  Each step checks
+  // the prefix of the node a lookup has reached, as in find_location,
+  // and then moves to the child and prefetches it.
+
+  void multi_find_(node* root, const K* keys, std::optional<V>* out, size_t n) {
+    struct lookup {node* c; node_ptr* cptr; int byte_pos; size_t i;};
+    lookup s[flck::multi_find_width];
+    // moves to the child of l.c, returns false if there is none
+    auto descend = [&] (lookup& l) {
+      l.cptr = get_child(l.c, keys[l.i]);
+      if (l.cptr == nullptr) return false;
+      l.c = l.cptr->load();
+      if (l.c == nullptr) return false;
+      __builtin_prefetch (l.c);
+      __builtin_prefetch (((char*) l.c) + 64);
+      return true;};
+    // starts a lookup at the root, returns false if already done
+    auto start = [&] (lookup& l, size_t i) {
+      l = lookup{root, nullptr, 0, i};
+      if (descend(l)) return true;
+      if (l.cptr != nullptr) l.cptr->validate();
+      out[i] = {};
+      return false;};
+    size_t next = 0;
+    int active = 0;
+    while (active < flck::multi_find_width && next < n)
+      if (start(s[active], next++)) active++;
+    while (active > 0) {
+      for (int j = 0; j < active; ) {
+	lookup& l = s[j];
+	const K& k = keys[l.i];
+	node* c = l.c;
+	l.byte_pos++;
+	while (l.byte_pos < c->byte_num &&
+	       get_byte(k, l.byte_pos) == get_byte(c->key, l.byte_pos))
+	  l.byte_pos++;
+	if (l.byte_pos == c->byte_num && c->nt != Leaf && descend(l)) {
+	  j++; continue;
+	}
+	// done, start the next key in its place
+	if (l.cptr != nullptr) l.cptr->validate();
+	if (c == l.c && is_leaf_for(c, l.byte_pos))
+	  out[l.i] = std::optional<V>(((leaf*) c)->value);
+	else out[l.i] = {};
+	bool started = false;
+	while (!started && next < n) started = start(l, next++);
+	if (started) j++;
+	else l = s[--active];
+      }
+    }
+  }
+
+  void multi_find(node* root, const K* keys, std::optional<V>* out, size_t n) {
+    flck::with_epoch([&] {multi_find_(root, keys, out, n);});
+  }
+
+  // start (end) is null once all keys below a are known to be at
+  // least start (at most end)
   template<typename AddF>
   void range_internal(node* a, AddF& add,
-		      std::optional<K> start, std::optional<K> end, int pos) {
+		      const K* start, const K* end, int pos) {
     if (a == nullptr) return;
-    std::optional<K> empty;
     if (a->nt == Leaf) {
-      if ((!start.has_value() || start.value() <= a->key)
-	  && (!end.has_value() || end.value() >= a->key)) 
+      if ((start == nullptr || *start <= a->key)
+	  && (end == nullptr || *end >= a->key)) 
 	add(a->key, ((leaf*) a)->value);
       return;
     }
     for (int i = pos; i < a->byte_num; i++) {
-      if (start == empty && end == empty) break;
-      if (start.has_value() && get_byte(start.value(), i) > get_byte(a->key, i)
-	  || end.has_value() && get_byte(end.value(), i) < get_byte(a->key, i))
+      if (start == nullptr && end == nullptr) break;
+      if ((start != nullptr && get_byte(*start, i) > get_byte(a->key, i))
+	  || (end != nullptr && get_byte(*end, i) < get_byte(a->key, i)))
 	return;
-      if (start.has_value() && get_byte(start.value(), i) < get_byte(a->key,i)) 
-	start = empty;
-      if (end.has_value() && get_byte(end.value(), i) > get_byte(a->key, i)) {
-	end = empty;
+      if (start != nullptr && get_byte(*start, i) < get_byte(a->key,i)) 
+	start = nullptr;
+      if (end != nullptr && get_byte(*end, i) > get_byte(a->key, i)) {
+	end = nullptr;
       }
     }
-    int sb = start.has_value() ? get_byte(start.value(), a->byte_num) : 0;
-    int eb = end.has_value() ? get_byte(end.value(), a->byte_num) : 255;
+    int sb = start != nullptr ? get_byte(*start, a->byte_num) : 0;
+    int eb = end != nullptr ? get_byte(*end, a->byte_num) : 255;
     if (a->nt == Full) {
       for (int i = sb; i <= eb; i++) 
 	range_internal(((full_node*) a)->children[i].read_snapshot(), add,
@@ -411,19 +652,107 @@ struct Set {
   }		       
 
   template<typename AddF>
-  void range_(node* root, AddF& add, K start, K end) {
-    range_internal(root, add,
-		   std::optional<K>(start), std::optional<K>(end), 0);
+  void range_(node* root, AddF& add, const K& start, const K& end) {
+    range_internal(root, add, &start, &end, 0);
+  }
+
+  // atomic if compiled with Persistent
+  template<typename AddF>
+  void range(node* root, AddF& add, K start, K end) {
+    flck::with_snap([&] {range_(root, add, start, end);});
   }
 
   node* empty() {
     auto r = full_pool.new_obj();
     r->byte_num = 0;
-    r->key = 0;
+    r->key = K();
     return (node*) r;
   }
 
   node* empty(size_t n) { return empty(); }
+
+  // Builds a tree from key-value pairs in any order, keeping the first
+  // of any duplicate keys.  Once sorted, the keys below a node are a
+  // contiguous range, so each node is built from a range of keys: its
+  // byte position is the first byte at which the first and last keys
+  // of the range differ, and its children are the subranges that
+  // agree on that byte.  Subtrees are built in parallel and nodes are
+  // the smallest kind that fits their children.
+  node* build(parlay::sequence<KV> kvs) {
+    auto a = flck::sort_unique_keys(std::move(kvs));
+
+    // Puts the start of each subrange of [start, end) with the same
+    // byte b in bounds, followed by end, and returns the number of
+    // subranges.
+    using bounds_t = std::array<size_t, 257>;
+    auto split = [&] (size_t start, size_t end, int b, bounds_t& bounds) {
+      auto new_byte = [&] (size_t i) {
+	return i == start || get_byte(a[i].key, b) != get_byte(a[i-1].key, b);};
+      int d = 0;
+      if (end - start > 2048) {
+	auto starts = parlay::pack_index<size_t>(parlay::delayed_tabulate(
+	    end - start, [&] (size_t i) {return new_byte(start + i);}));
+	for (size_t x : starts) bounds[d++] = start + x;
+      } else
+	for (size_t i = start; i < end; i++)
+	  if (new_byte(i)) bounds[d++] = i;
+      bounds[d] = end;
+      return d;};
+
+    // builds the subtree for [start, end) given the parent's byte_num
+    std::function<node*(size_t, size_t, int)> build_rec;
+    // fills a node at byte b with the subtrees for the subranges
+    auto build_children = [&] (bounds_t& bounds, int d, int b,
+			       auto add_child) {
+      auto build_child = [&] (size_t i) {
+	  add_child(i, get_byte(a[bounds[i]].key, b),
+		    build_rec(bounds[i], bounds[i+1], b));};
+      if (bounds[d] - bounds[0] < 1000)
+	for (int i = 0; i < d; i++) build_child(i);
+      else parlay::parallel_for(0, d, build_child, 1);};
+
+    build_rec = [&] (size_t start, size_t end, int parent_byte) -> node* {
+      if (end - start == 1)
+	return (node*) leaf_pool.new_obj(a[start].key, a[start].value);
+      const K& k = a[start].key;
+      int b = parent_byte + 1;
+      while (get_byte(k, b) == get_byte(a[end-1].key, b)) b++;
+      bounds_t bounds;
+      int d = split(start, end, b, bounds);
+      if (d <= 16)
+	return (node*) sparse_pool.new_init([&] (sparse_node* s_n) {
+	    s_n->key = key_prefix(k, b);
+	    s_n->byte_num = b;
+	    s_n->num_used = d;
+	    build_children(bounds, d, b, [&] (int i, int kb, node* c) {
+		s_n->keys[i] = kb;
+		s_n->ptr[i].init(c);});});
+      else if (d <= 64)
+	return (node*) indirect_pool.new_init([&] (indirect_node* i_n) {
+	    i_n->key = key_prefix(k, b);
+	    i_n->byte_num = b;
+	    i_n->num_used.init(d);
+	    build_children(bounds, d, b, [&] (int i, int kb, node* c) {
+		i_n->idx[kb].init(i);
+		i_n->ptr[i].init(c);});});
+      else
+	return (node*) full_pool.new_init([&] (full_node* f_n) {
+	    f_n->key = key_prefix(k, b);
+	    f_n->byte_num = b;
+	    build_children(bounds, d, b, [&] (int i, int kb, node* c) {
+		f_n->children[kb].init(c);});});
+    };
+
+    // the root is always a full node on byte 0
+    full_node* r = (full_node*) empty();
+    if (a.size() > 0) {
+      bounds_t bounds;
+      int d = split(0, a.size(), 0, bounds);
+      build_children(bounds, d, 0, [&] (int i, int kb, node* c) {
+	  r->children[kb].init(c);});
+    }
+    return (node*) r;
+  }
   
   void print(node* p) {
     std::function<void(node*)> prec;
@@ -516,6 +845,20 @@ struct Set {
     return cnt;
   }
 
+  // bytes used by the nodes and leaves reachable from p (not counting
+  // memory held by string keys or not yet reclaimed)
+  size_t bytes_used(node* p) {
+    if (p == nullptr) return 0;
+    if (p->nt == Leaf) return sizeof(leaf);
+    parlay::sequence<node*> children;
+    for_each_child(p, [&] (int b, node* c) {children.push_back(c);});
+    size_t below = parlay::reduce(parlay::map(children, [&] (node* c) {
+	  return bytes_used(c);}));
+    if (p->nt == Sparse) return sizeof(sparse_node) + below;
+    else if (p->nt == Indirect) return sizeof(indirect_node) + below;
+    else return sizeof(full_node) + below;
+  }
+
   void clear() {
     full_pool.clear();
     indirect_pool.clear();
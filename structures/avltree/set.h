@@ -12,7 +12,7 @@
 
 // TODO: minimize number of writes to the log
 
-template <typename K, typename V>
+template <typename K, typename V, typename Backoff = flck::retry_backoff>
 struct Set {
 
   K key_min = std::numeric_limits<K>::min();
@@ -259,6 +259,7 @@ struct Set {
     // std::cout << "insert " << k << std::endl;
     return flck::with_epoch([=] {
       int cnt = 0;
+      Backoff b;
       while (true) {
         auto [gp, gp_left, p, p_left, l] = find_location(root, k);
         if (k == l->key) return false;
@@ -280,6 +281,7 @@ struct Set {
         if (cnt++ > max_iters) {
           std::cout << "too many iters" << std::endl; abort();
         }
+        b.wait();
       }
     });
     // check(root);
@@ -289,6 +291,7 @@ struct Set {
   bool remove(node* root, K k) {
     return flck::with_epoch([=] {
        int cnt = 0;
+       Backoff b;
        while (true) {
    auto [gp, gp_left, p, p_left, l] = find_location(root, k);
    if (k != l->key) return false;
@@ -311,6 +314,7 @@ struct Set {
      return true;
    }
    if (cnt++ > max_iters) {std::cout << "too many iters" << std::endl; abort();}
+   b.wait();
        }}); 
   }
 
@@ -18,10 +18,12 @@ struct Rebalance {
   // If priority of c (child) is less than p (parent), then it rotates c
   // above p to ensure priorities are in heap order.  Two new nodes are
   // created and gp (grandparent) is updated to point to the new copy of c.
-  // The key k is needed to decide the side of p from gp, and c from p.
-  bool fix_priority(node* gp, node* p, node* c, int k) {
+  // The key k is needed to decide the side of c from p.  The side of p
+  // from gp is taken from gp's pointers since gp can be the root, which
+  // has no key.
+  bool fix_priority(node* gp, node* p, node* c, K k) {
     return gp->try_lock([=] {
-	auto ptr = (k < gp->key) ? &(gp->left) : &(gp->right);
+	auto ptr = (gp->left.load() == p) ? &(gp->left) : &(gp->right);
 	return (!gp->removed.load() && // gp has not been removed
 		ptr->load() == p &&    // p has not changed
 		p->try_lock([=] {
@@ -45,7 +47,7 @@ struct Rebalance {
       });
   }
 
-  void fix_path(node* root, int k) {
+  void fix_path(node* root, K k) {
     while (true) {
       node* gp = root;
       node* p = (gp->left).load();
@@ -62,8 +64,9 @@ struct Rebalance {
   }
 
 
-  void rebalance(node* p, node* root, int k) {
-    node* c = (k < p->key) ? (p->left).load() : (p->right).load();
+  // p is the parent the insert was done under (the root only has a left child)
+  void rebalance(node* p, node* root, K k) {
+    node* c = (p == root || k < p->key) ? (p->left).load() : (p->right).load();
     if (!c->is_leaf) fix_path(root, k);
   }
 
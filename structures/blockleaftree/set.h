@@ -7,7 +7,7 @@ bool balanced = true;
 bool balanced = false;
 #endif
 
-template <typename K_, typename V_>
+template <typename K_, typename V_, typename Backoff = flck::retry_backoff>
 struct Set {
   using K = K_;
   using V = V_;
@@ -55,7 +55,7 @@ struct Set {
   flck::memory_pool<node> node_pool;
   flck::memory_pool<leaf> leaf_pool;
 
-  Rebalance<Set<K,V>> balance;
+  Rebalance<Set> balance;
   Set() : balance(this) {}
 
   enum direction {left, right};
@@ -85,6 +85,7 @@ struct Set {
   // without being read, or just read).
   bool insert(node* root, K k, V v) {
     return flck::with_epoch([=] {
+      Backoff b;
       while (true) {
 	auto [gp, gp_left, p, p_left, l] = find_location(root, k);
 	leaf* old_l = (leaf*) l;
@@ -140,6 +141,7 @@ struct Set {
 	  return true;
 	}
 	// try again if unsuccessful
+	b.wait();
       }
     });
   }
@@ -148,6 +150,7 @@ struct Set {
   // removing it, then both the leaf and its parent need to be deleted.
   bool remove(node* root, K k) {
     return flck::with_epoch([=] {
+      Backoff b;
       while (true) {
 	auto [gp, gp_left, p, p_left, l] = find_location(root, k);
 	leaf* old_l = (leaf*) l;
@@ -200,6 +203,7 @@ struct Set {
 	    return true;
 	} else return true;
 	// try again if unsuccessful
+	b.wait();
       }
     });
   }
@@ -1,13 +1,26 @@
 #define Range_Search 1
+#define Multi_Find 1
+#define Bulk_Build 1
+#define Upsert 1
 #include <flock/flock.h>
 #include <parlay/primitives.h>
+#if defined(BtreeVectorRank) && defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 // A top-down implementation of abtrees
 // Nodes are split or joined on the way down to ensure that each node
 // can fit one more child, or remove one more child.
 
-template <typename K_, typename V_>
-struct Set {
+// the default number of children of a node and entries of a leaf
+#ifndef BtreeFanout
+#define BtreeFanout 15
+#endif
+
+template <typename K_, typename V_,
+	  typename Backoff = flck::default_backoff,
+	  int NodeSize = BtreeFanout, int LeafSize = BtreeFanout>
+struct Set : flck::upsert_ops<Set<K_, V_, Backoff, NodeSize, LeafSize>, K_, V_> {
   using K = K_;
   using V = V_;
   
@@ -15,13 +28,46 @@ struct Set {
 
   // for 8 byte keys and 8 byte values
   // it should be a length such that l mod 4 = 3
-  // this is so it fills a cache line
-  static constexpr int leaf_block_size = 15;
-  static constexpr int leaf_min_size = 3;
-  static constexpr int leaf_join_cutoff = 12;
-  static constexpr int node_block_size = 15;
-  static constexpr int node_min_size = 3;
-  static constexpr int node_join_cutoff = 12;
+  // this is so it fills a cache line (15, 31 or 63)
+  static constexpr int leaf_block_size = LeafSize;
+  static constexpr int leaf_min_size = LeafSize / 5;
+  static constexpr int leaf_join_cutoff = LeafSize * 4 / 5;
+  static constexpr int node_block_size = NodeSize;
+  static constexpr int node_min_size = NodeSize / 5;
+  static constexpr int node_join_cutoff = NodeSize * 4 / 5;
+  static_assert(leaf_min_size >= 2 && node_min_size >= 2 && NodeSize < 128,
+		"btree node sizes must be between 10 and 127");
+
+  // Returns the number of the n sorted keys that are less than k, or
+  // at most k if Inclusive, i.e. the position of k among the keys.
+  // It scans until the first key that does not compare true.  If
+  // compiled with BtreeVectorRank and AVX-512, 8 byte integer keys are
+  // instead compared 8 at a time, counting those that compare true and
+  // using masked loads so it never reads past the n keys.  This was no
+  // faster with 15 entry nodes.
+  template <bool Inclusive>
+  static int rank(const K* keys, int n, K k) {
+#if defined(BtreeVectorRank) && defined(__AVX512F__)
+    if constexpr (std::is_integral_v<K> && sizeof(K) == 8) {
+      constexpr int cmp = Inclusive ? _MM_CMPINT_LE : _MM_CMPINT_LT;
+      __m512i kv = _mm512_set1_epi64((long long) k);
+      int r = 0;
+      for (int j = 0; j < n; j += 8) {
+	__mmask8 valid = (n - j >= 8) ? 0xff : (__mmask8) ((1u << (n - j)) - 1);
+	__m512i v = _mm512_maskz_loadu_epi64(valid, keys + j);
+	__mmask8 m = (std::is_signed_v<K>
+		      ? _mm512_mask_cmp_epi64_mask(valid, v, kv, cmp)
+		      : _mm512_mask_cmp_epu64_mask(valid, v, kv, cmp));
+	r += __builtin_popcount(m);
+      }
+      return r;
+    }
+#endif
+    int i = 0;
+    if constexpr (Inclusive) while (i < n && keys[i] <= k) i++;
+    else while (i < n && keys[i] < k) i++;
+    return i;
+  }
     
   // ***************************************
   // Internal Nodes
@@ -47,12 +93,12 @@ struct Set {
   struct alignas(64) node : header {
     flck::atomic_write_once<bool> removed;
     K keys[node_block_size-1];
-    flck::atomic<node*> children[node_block_size];
+    flck::ptr_type<node> children[node_block_size];
     flck::lock lck;
     
-    int find(K k, uint i=0) {
-      while (i < header::size-1 && keys[i] <= k) i++;
-      return i;
+    // the child that k belongs in
+    int find(K k) {
+      return rank<true>(keys, header::size-1, k);
     }
 
     // create with given size, to be filled in
@@ -209,21 +255,25 @@ struct Set {
   // Leafs
   // ***************************************
 
-  // Leafs are immutable.  Once created and the keyvals set, their values
-  // will not be changed.
+  // Leafs are immutable.  Once created and the keys and values set,
+  // they will not be changed.  The keys are kept apart from the values
+  // so a search only touches the keys.
   struct alignas(64) leaf : header {
-    KV keyvals[leaf_block_size];
-    
+    K keys[leaf_block_size];
+    V values[leaf_block_size];
+
+    KV get(int i) {return KV{keys[i], values[i]};}
+    void set(int i, KV kv) {keys[i] = kv.key; values[i] = kv.value;}
+
     std::optional<V> find(K k) {
-      int i=0;
-      while (i < header::size && keyvals[i].key < k) i++;
-      if (i == header::size || keyvals[i].key != k) return {};
-      else return keyvals[i].value;
+      int i = prev(k);
+      if (i == header::size || keys[i] != k) return {};
+      else return values[i];
     }
 
-    int prev(K k, int i=0) {
-      while (i < header::size && keyvals[i].key < k) i++;
-      return i;
+    // the number of keys less than k
+    int prev(K k) {
+      return rank<false>(keys, header::size, k);
     }
     
     leaf(int size) :
@@ -238,7 +288,7 @@ struct Set {
     int size = l->size;
     leaf* new_l = leaf_pool.new_obj(size);
     for (int i=0; i < size; i++)
-      new_l->keyvals[i] = l->keyvals[i];
+      new_l->set(i, l->get(i));
     leaf_pool.retire(l);
     return new_l;
   }
@@ -253,19 +303,29 @@ struct Set {
     int i=0;
 
     // copy part before the new key
-    for (;i < size && l->keyvals[i].key < k; i++)
-      new_l->keyvals[i] = l->keyvals[i];
+    for (;i < size && l->keys[i] < k; i++)
+      new_l->set(i, l->get(i));
 
     // copy in the new key and value
-    new_l->keyvals[i] = KV{k,v};
+    new_l->set(i, KV{k,v});
 
     // copy the part after the new key
     for (; i < size ; i++ )
-      new_l->keyvals[i+1] = l->keyvals[i];
+      new_l->set(i+1, l->get(i));
 
     return new_l;
   }
 
+  // Copy the leaf giving the key k, which must be present, the value v.
+  leaf* update_leaf(leaf* l, K k, V v) {
+    int size = l->size;
+    leaf* new_l = leaf_pool.new_obj(size);
+    for (int i=0; i < size; i++)
+      new_l->set(i, l->get(i));
+    new_l->values[l->prev(k)] = v;
+    return new_l;
+  }
+
   // Remove a key-value pair from the leaf that matches the key k.
   // This copies the values into a new leaf.
   leaf* remove_leaf(leaf* l, K k) {
@@ -275,12 +335,12 @@ struct Set {
     int i=0;
 
     // part before the key
-    for (;i < size && l->keyvals[i].key < k; i++)
-      new_l->keyvals[i] = l->keyvals[i];
+    for (;i < size && l->keys[i] < k; i++)
+      new_l->set(i, l->get(i));
 
     // part after the key, shifted left
     for (; i < size-1 ; i++ )
-      new_l->keyvals[i] = l->keyvals[i+1];
+      new_l->set(i, l->get(i+1));
 
     return new_l;
   }
@@ -295,8 +355,8 @@ struct Set {
     leaf* new_r = leaf_pool.new_obj(size-lsize);
     // hack to deal with broken g++-10 compiler
     if (true) {
-      K tmpK[20];
-      V tmpV[20];
+      K tmpK[leaf_block_size+1];
+      V tmpV[leaf_block_size+1];
 
       for (int i = 0; i < lsize; i++) {
         auto [key,val] = get_kv(i);
@@ -304,8 +364,8 @@ struct Set {
         tmpV[i] = val;
       }
       for (int i = 0; i < lsize; i++) {
-        new_l->keyvals[i].key = tmpK[i];
-        new_l->keyvals[i].value = tmpV[i];
+        new_l->keys[i] = tmpK[i];
+        new_l->values[i] = tmpV[i];
       }
       for (int i = 0; i < size - lsize; i++) {
         auto [key,val] = get_kv(i+lsize);      
@@ -313,12 +373,12 @@ struct Set {
         tmpV[i] = val;
       }
       for (int i = 0; i < size - lsize; i++) {
-        new_r->keyvals[i].key = tmpK[i];
-        new_r->keyvals[i].value = tmpV[i];
+        new_r->keys[i] = tmpK[i];
+        new_r->values[i] = tmpV[i];
       }
     } else {
-      for (int i = 0; i < lsize; i++) new_l->keyvals[i] = get_kv(i);
-      for (int i = 0; i < size - lsize; i++) new_r->keyvals[i] = get_kv(i+lsize);
+      for (int i = 0; i < lsize; i++) new_l->set(i, get_kv(i));
+      for (int i = 0; i < size - lsize; i++) new_r->set(i, get_kv(i+lsize));
     }
 
     // separating key (first key in right child)
@@ -332,15 +392,15 @@ struct Set {
     leaf* l = (leaf*) p;
     int size = l->size;
     assert(size == leaf_block_size);
-    auto result = split_mid_leaf(size, [=] (int i) {return l->keyvals[i];});
+    auto result = split_mid_leaf(size, [=] (int i) {return l->get(i);});
     return result;
   }
 
   std::tuple<node*,K,node*> rebalance_leaf(node* l, node* r) {
     int size = l->size + r->size;
     auto result = split_mid_leaf(size, [=] (int i) {
-         if (i < l->size) return ((leaf*) l)->keyvals[i];
-	 else return ((leaf*) r)->keyvals[i - l->size];});
+         if (i < l->size) return ((leaf*) l)->get(i);
+	 else return ((leaf*) r)->get(i - l->size);});
     return result;
   }
 
@@ -348,9 +408,9 @@ struct Set {
     int size = l->size + r->size;
     leaf* new_l = leaf_pool.new_obj(size);
     for (int i=0; i < size; i++)
-      new_l->keyvals[i] = ((i < l->size) 
-			   ? ((leaf*) l)->keyvals[i] 
-			   : ((leaf*) r)->keyvals[i - l->size]);
+      new_l->set(i, ((i < l->size) 
+		     ? ((leaf*) l)->get(i) 
+		     : ((leaf*) r)->get(i - l->size)));
     return (node*) new_l;
   }
 
@@ -369,14 +429,14 @@ struct Set {
 	return p->lck.try_lock([=] {
 	    // check that c has not changed
 	    if (p->children[cidx].load() != c) return false;
-	    if (c->is_leaf) {
+	    if (c->is_leaf)
 	      gp->children[pidx] = add_child(p, split_leaf(c), cidx);
-	      leaf_pool.retire((leaf*) c);
-	    } else {
-		gp->children[pidx] = add_child(p, split(c), cidx);
-		node_pool.retire(c);
-	    }
-	    node_pool.retire(p);
+	    else
+	      gp->children[pidx] = add_child(p, split(c), cidx);
+	    flck::run_once([=] { // one log entry for both retires
+	      if (c->is_leaf) leaf_pool.retire((leaf*) c);
+	      else node_pool.retire(c);
+	      node_pool.retire(p);});
 	    return true;
 	  });});
   }
@@ -401,9 +461,10 @@ struct Set {
 		gp->children[pidx] = join_children(p, join_leaf(lc, rc), li);
 	      else   // rebalance
 		gp->children[pidx] = rebalance_children(p, rebalance_leaf(lc, rc), li);
-	      node_pool.retire(p);
-	      leaf_pool.retire((leaf*) lc);
-	      leaf_pool.retire((leaf*) rc);
+	      flck::run_once([=] { // one log entry for all three retires
+		node_pool.retire(p);
+		leaf_pool.retire((leaf*) lc);
+		leaf_pool.retire((leaf*) rc);});
 	      return true;
 	    } else { // internal node
 	      K k = p->keys[li];
@@ -414,9 +475,10 @@ struct Set {
 		    gp->children[pidx] = join_children(p, join(lc, k, rc), li);
 		  else // rebalance
 		    gp->children[pidx] = rebalance_children(p, rebalance(lc, k, rc), li);
-		  node_pool.retire(p);
-		  node_pool.retire(lc);
-		  node_pool.retire(rc);
+		  flck::run_once([=] {
+		    node_pool.retire(p);
+		    node_pool.retire(lc);
+		    node_pool.retire(rc);});
 		  return true;
 		});
 	    }
@@ -505,9 +567,6 @@ struct Set {
     }
   }
 
-  static constexpr int init_delay=200;
-  static constexpr int max_delay=2000;
-
   // Inserts by finding the leaf containing the key, and inserting
   // into the leaf.  Since the find ensures the leaf is not full,
   // there will be space for the new key.  It needs a lock on the
@@ -517,7 +576,7 @@ struct Set {
   // returns false and does no update if already in tree
   bool insert(node* root, K k, V v) {
     return flck::with_epoch([=] {
-      int delay = init_delay;
+      Backoff b;
       while (true) {
 	auto [p, cidx, l] = find_and_fix(root, k);
 	if (l->find(k).has_value()) return false; // already there
@@ -528,8 +587,7 @@ struct Set {
 	      leaf_pool.retire(l);
 	      return true;
 	    })) return true;
-	for (volatile int i=0; i < delay; i++);
-	delay = std::min(2*delay, max_delay);
+	b.wait();
       }});
   }
 
@@ -540,7 +598,7 @@ struct Set {
   // not found.
   bool remove(node* root, K k) {
     return flck::with_epoch([=] {
-      int delay = init_delay;
+      Backoff b;
       while (true) {
         auto [p, cidx, l] = find_and_fix(root, k);
 	if (!l->find(k).has_value()) return false; // not there
@@ -551,41 +609,128 @@ struct Set {
 	      leaf_pool.retire(l);
 	      return true;
 	    })) return true;
-	for (volatile int i=0; i < delay; i++);
-	delay = std::min(2*delay, max_delay);
+	b.wait();
       }});
   }
 
-  template<typename AddF>
-  void range_internal(node* a, AddF& add, K start, K end) {
+  // upsert_f for flck::upsert_ops.  Either way it is one copy of the
+  // leaf under the parent's lock, as for insert.
+  template <typename F>
+  std::optional<V> upsert_f(node* root, K k, F f) {
+    return flck::with_epoch([=] {
+      Backoff b;
+      while (true) {
+	auto [p, cidx, l] = find_and_fix(root, k);
+	std::optional<V> old = l->find(k);
+	std::optional<V> new_v = f(old);
+	if (!new_v.has_value()) return old;
+	V v = *new_v;
+	bool present = old.has_value();
+	if (p->lck.try_lock([=] {
+	      if (p->removed.load() || (leaf*) p->children[cidx].load() != l)
+		return false;
+	      p->children[cidx] = (node*) (present ? update_leaf(l, k, v)
+					   : insert_leaf(l, k, v));
+	      leaf_pool.retire(l);
+	      return true;
+	    })) return old;
+	b.wait();
+      }});
+  }
+
+  // The most levels a path from the root can have.  Every node below
+  // the root has at least two children.
+  static constexpr int max_depth = 64;
+
+  // Calls f(k, v) on the keys from start onwards (inclusive or not)
+  // in order, until f returns false.  It descends from the root once,
+  // keeping the path, and then moves from a leaf to the next by going
+  // up to the nearest ancestor with a child to the right and down the
+  // leftmost path of that child.
+  template<typename F>
+  void scan_(node* root, K start, bool inclusive, F f) {
+    node* path[max_depth];
+    int idx[max_depth];
+    int d = 0;
+    node* a = root;
+    while (!a->is_leaf) {
+      path[d] = a;
+      idx[d] = a->find(start);
+      a = a->children[idx[d++]].read_snapshot();
+    }
+    leaf* l = (leaf*) a;
+    int i = inclusive ? l->prev(start) : rank<true>(l->keys, l->size, start);
     while (true) {
-      if (a->is_leaf) {
-	leaf* la = (leaf*) a;
-	int s = la->prev(start, 0);
-	int e = la->prev(end, s);
-	for (int i = s; i < e; i++) add(la->keyvals[i].key, la->keyvals[i].value);
-	return;
-      }
-      int s = a->find(start);
-      int e = a->find(end, s);
-      if (s == e) a = a->children[s].read_snapshot();
-      else {
-	for (int i = s; i <= e; i++) 
-	  range_internal(a->children[i].read_snapshot(), add, start, end);
-	return;
+      for (; i < l->size; i++)
+	if (!f(l->keys[i], l->values[i])) return;
+      while (d > 0 && idx[d-1] + 1 == path[d-1]->size) d--;
+      if (d == 0) return;
+      a = path[d-1]->children[++idx[d-1]].read_snapshot();
+      while (!a->is_leaf) {
+	path[d] = a;
+	idx[d++] = 0;
+	a = a->children[0].read_snapshot();
       }
+      l = (leaf*) a;
+      i = 0;
     }
   }
 
+  // inclusive of end, as for the other structures
   template<typename AddF>
   void range_(node* root, AddF& add, K start, K end) {
-      range_internal(root, add, start, end);
+    scan_(root, start, true, [&] (K k, V v) {
+	if (k > end) return false;
+	add(k, v);
+	return true;});
+  }
+
+  // atomic if compiled with Persistent
+  template<typename AddF>
+  void range(node* root, AddF& add, K start, K end) {
+    flck::with_snap([&] {range_(root, add, start, end);});
   }
     
+  // A position in the keys for reading them in order, a batch at a
+  // time (e.g. for pagination).  It keeps the last key read rather
+  // than pointers into the tree, so it stays valid when the tree
+  // changes and can be kept for any time.
+  struct cursor {
+    node* root;
+    K last;        // the last key read, or where to start if not started
+    bool started;
+    bool done;
+  };
+
+  // a cursor at the first key that is at least k
+  cursor seek(node* root, K k) { return cursor{root, k, false, false}; }
+
+  // Puts up to n of the next key-value pairs of the cursor in out and
+  // returns how many, which is fewer than n only at the end.  Each
+  // batch runs in one epoch (and one snapshot if Persistent).  It
+  // descends from the root once to the last key read, so a batch never
+  // reads a leaf that was replaced since the previous one, and then
+  // walks the leaves in order (see scan_).
+  size_t next_batch(cursor& c, KV* out, size_t n) {
+    if (c.done || n == 0) return 0;
+    size_t m = flck::with_snap([&] {
+	size_t m = 0;
+	scan_(c.root, c.last, !c.started, [&] (K k, V v) {
+	    out[m++] = KV{k, v};
+	    return m < n;});
+	return m;});
+    if (m < n) c.done = true;
+    if (m > 0) {
+      c.last = out[m-1].key;
+      c.started = true;
+    }
+    return m;
+  }
+
   // a wait-free version that does not split on way down
   std::optional<V> find_(node* root, K k) {
     node* c = root;
-    flck::atomic<node*>* x;
+    flck::ptr_type<node>* x;
     while (!c->is_leaf) {
       __builtin_prefetch (((char*) c) + 64); 
       __builtin_prefetch (((char*) c) + 128);
@@ -600,6 +745,41 @@ struct Set {
     return flck::with_epoch([&] {return find_(root, k);});
   }
 
+  // Interleaved lookups (see flck::multi_find_width).  Each step moves
+  // a lookup down one level and prefetches the node it reaches.
+
+  void multi_find_(node* root, const K* keys, std::optional<V>* out, size_t n) {
+    struct lookup {node* c; flck::ptr_type<node>* x; size_t i;};
+    lookup s[flck::multi_find_width];
+    size_t next = 0;
+    int active = 0;
+    while (active < flck::multi_find_width && next < n)
+      s[active++] = lookup{root, nullptr, next++};
+    while (active > 0) {
+      for (int j = 0; j < active; ) {
+	lookup& l = s[j];
+	if (!l.c->is_leaf) {
+	  l.x = &l.c->children[l.c->find(keys[l.i])];
+	  l.c = l.x->load();
+	  __builtin_prefetch (l.c);
+	  __builtin_prefetch (((char*) l.c) + 64);
+	  __builtin_prefetch (((char*) l.c) + 128);
+	  __builtin_prefetch (((char*) l.c) + 192);
+	  j++;
+	} else { // done, start the next key in its place
+	  l.x->validate();
+	  out[l.i] = ((leaf*) l.c)->find(keys[l.i]);
+	  if (next < n) { l = lookup{root, nullptr, next++}; j++;}
+	  else l = s[--active];
+	}
+      }
+    }
+  }
+
+  void multi_find(node* root, const K* keys, std::optional<V>* out, size_t n) {
+    flck::with_epoch([&] {multi_find_(root, keys, out, n);});
+  }
+
   // An empty tree is an empty leaf along with a root pointing tho the
   // leaf.  The root will always contain a single pointer.
   node* empty() {
@@ -609,6 +789,48 @@ struct Set {
 
   node* empty(size_t n) { return empty(); }
 
+  // Builds a tree from key-value pairs in any order, keeping the first
+  // of any duplicate keys.  It is built bottom up in parallel, one
+  // level at a time, with leaves and internal nodes filled to about
+  // fill times their capacity so that later inserts do not
+  // immediately split them.
+  node* build(parlay::sequence<KV> kvs, double fill = .8) {
+    auto a = flck::sort_unique_keys(std::move(kvs));
+    size_t n = a.size();
+    if (n == 0) return empty();
+
+    // nodes need more than min_size and fewer than block_size children
+    // to not be fixed on the way down
+    auto target = [=] (int min_size, int block_size) {
+      return std::clamp((int) (fill * block_size), min_size + 2, block_size - 1);};
+
+    // splits m into the fewest groups of at most t, evenly
+    auto groups = [] (size_t m, int t) {return (m + t - 1) / t;};
+
+    size_t m = groups(n, target(leaf_min_size, leaf_block_size));
+    auto level = parlay::tabulate(m, [&] (size_t i) {
+	size_t start = i * n / m;
+	size_t end = (i + 1) * n / m;
+	leaf* l = leaf_pool.new_obj(end - start);
+	for (size_t j = start; j < end; j++) l->set(j-start, a[j]);
+	return (node*) l;});
+    // the smallest key below each node in the level
+    auto mins = parlay::tabulate(m, [&] (size_t i) {return a[i * n / m].key;});
+
+    while (level.size() > 1) {
+      size_t c = level.size();
+      m = groups(c, target(node_min_size, node_block_size));
+      auto next_level = parlay::tabulate(m, [&] (size_t i) {
+	  size_t start = i * c / m;
+	  return copy((i + 1) * c / m - start,
+		      [&] (int j) {return mins[start + j + 1];},
+		      [&] (int j) {return level[start + j];});});
+      mins = parlay::tabulate(m, [&] (size_t i) {return mins[i * c / m];});
+      level = std::move(next_level);
+    }
+    return node_pool.new_obj((leaf*) level[0]);
+  }
+
   void retire(node* p) {
     if (p == nullptr) return;
     if (p->is_leaf) {
@@ -635,11 +857,11 @@ struct Set {
   rtup check_recursive(node* p, bool is_root) {
     if (p->is_leaf) {
       leaf* l = (leaf*) p;
-      K minv = l->keyvals[0].key;
-      K maxv = l->keyvals[0].key;
+      K minv = l->keys[0];
+      K maxv = l->keys[0];
       for (int i=1; i < l->size; i++) {
-	minv = std::min(minv, l->keyvals[i].key);
-	maxv = std::max(minv, l->keyvals[i].key);
+	minv = std::min(minv, l->keys[i]);
+	maxv = std::max(minv, l->keys[i]);
       }
       return rtup(minv, maxv, l->size);
     }
@@ -678,7 +900,7 @@ struct Set {
 	     if (p->is_leaf) {
 	       leaf* l = (leaf*) p;
 	       for (int i=0; i < l->size; i++) 
-		 std::cout << l->keyvals[i].key << ", ";
+		 std::cout << l->keys[i] << ", ";
 	     } else {
 	       for (int i=0; i < p->size; i++) {
 		 prec((p->children[i]).load());
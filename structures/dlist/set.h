@@ -2,14 +2,14 @@
 #include <flock/flock.h>
 #define Range_Search 1
 
-template <typename K, typename V>
+template <typename K, typename V, typename Backoff = flck::default_backoff>
 struct Set {
 
   struct alignas(64) node : flck::lock {
     bool is_end;
     flck::atomic_write_once<bool> removed;
     flck::atomic<node*> prev;
-    flck::atomic<node*> next;
+    flck::ptr_type<node> next;
     K key;
     V value;
     node(K key, V value, node* next, node* prev)
@@ -33,12 +33,9 @@ struct Set {
 
   
 
-  static constexpr int init_delay=200;
-  static constexpr int max_delay=2000;
-
   bool insert(node* root, K k, V v) {
     return flck::with_epoch([&] {
-      int delay = init_delay;
+      Backoff b;
       while (true) {
 	node* next = find_location(root, k);
 	if (!next->is_end && next->key == k) return false;
@@ -53,15 +50,14 @@ struct Set {
 		  return true;
 		} else return false;}))
 	  return true;
-	for (volatile int i=0; i < delay; i++);
-	delay = std::min(2*delay, max_delay);
+	b.wait();
       }
     });
   }
 
   bool remove(node* root, K k) {
     return flck::with_epoch([&] {
-      int delay = init_delay;
+      Backoff b;
       while (true) {
 	node* loc = find_location(root, k);
 	if (loc->is_end || loc->key != k) return false;
@@ -78,8 +74,7 @@ struct Set {
 		  return true;
 		});}))
 	  return true;
-	for (volatile int i=0; i < delay; i++);
-	delay = std::min(2*delay, max_delay);
+	b.wait();
       }
     });
   }
@@ -94,14 +89,23 @@ struct Set {
     return flck::with_epoch([&] { return find_(root, k);});
   }
 
+  // follows the snapshot from the root so the result is atomic if
+  // compiled with Persistent
   template<typename AddF>
   void range_(node* root, AddF& add, K start, K end) {
-      auto nxt = find_location(root, start);
+      node* nxt = (root->next).read_snapshot();
+      while (!nxt->is_end && nxt->key < start)
+	nxt = (nxt->next).read_snapshot();
       while (!nxt->is_end && nxt->key <= end) {
 	add(nxt->key, nxt->value);
-	nxt = nxt->next.load();
+	nxt = (nxt->next).read_snapshot();
       }
   }
+
+  template<typename AddF>
+  void range(node* root, AddF& add, K start, K end) {
+    flck::with_snap([&] {range_(root, add, start, end);});
+  }
   
   node* empty() {
     node* tail = node_pool.new_obj(nullptr);
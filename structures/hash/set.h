@@ -1,8 +1,10 @@
+#define Multi_Find 1
+#define Upsert 1
 #include <flock/flock.h>
 #include <parlay/primitives.h>
 
-template <typename K, typename V>
-struct Set {
+template <typename K, typename V, typename Backoff = flck::retry_backoff>
+struct Set : flck::upsert_ops<Set<K, V, Backoff>, K, V> {
 
   struct alignas(32) node {
     K key;
@@ -55,7 +57,49 @@ struct Set {
     else return {};
   }
 
+  // Interleaved lookups (see flck::multi_find_width).  Each step reads
+  // the next pointer in a bucket and prefetches the node it points to.
+
+  void multi_find_(Table& table, const K* keys, std::optional<V>* out, size_t n) {
+    // nxt is nullptr until the head of the bucket is read
+    struct lookup {flck::atomic<node*>* cur; node* nxt; size_t i;};
+    lookup s[flck::multi_find_width];
+    auto start = [&] (size_t i) {
+      slot* sl = get_slot(table, keys[i]);
+      __builtin_prefetch (sl);
+      return lookup{&sl->head, nullptr, i};};
+    size_t next = 0;
+    int active = 0;
+    while (active < flck::multi_find_width && next < n)
+      s[active++] = start(next++);
+    while (active > 0) {
+      for (int j = 0; j < active; ) {
+	lookup& l = s[j];
+	bool done;
+	if (l.nxt != nullptr && l.nxt->key == keys[l.i]) done = true;
+	else {
+	  if (l.nxt != nullptr) l.cur = &(l.nxt->next);
+	  l.nxt = l.cur->read();
+	  done = (l.nxt == nullptr);
+	  __builtin_prefetch (l.nxt);
+	}
+	if (!done) { j++; continue;}
+	// done, start the next key in its place
+	l.cur->validate();
+	if (l.nxt != nullptr) out[l.i] = l.nxt->value;
+	else out[l.i] = {};
+	if (next < n) { l = start(next++); j++;}
+	else l = s[--active];
+      }
+    }
+  }
+
+  void multi_find(Table& table, const K* keys, std::optional<V>* out, size_t n) {
+    flck::with_epoch([&] {multi_find_(table, keys, out, n);});
+  }
+
   bool insert_at(slot* s, K k, V v) {
+    Backoff b;
     while (true) {
       unsigned int vn = s->version_num.load();
       auto [cur, nxt] = find_in_slot(s, k);
@@ -66,6 +110,7 @@ struct Set {
 	    s->version_num = vn+1;
 	    return true;}))
 	return true;
+      b.wait();
     }
 
   }
@@ -76,6 +121,7 @@ struct Set {
   }
 			
   bool remove_at(slot* s, K k) {
+    Backoff b;
     while (true) {
       unsigned int vn = s->version_num.load();
       auto [cur, nxt] = find_in_slot(s, k);
@@ -87,6 +133,7 @@ struct Set {
 	    s->version_num = vn+1;
 	    return true;}))
 	return true;
+      b.wait();
     }
   }
 
@@ -94,6 +141,40 @@ struct Set {
     slot* s = get_slot(table, k);
     return flck::with_epoch([&] {return remove_at(s, k);});
   }
+
+  // upsert_f on slot s.  A present key's node is replaced by a copy
+  // with the new value, under the slot's lock.
+  template <typename F>
+  std::optional<V> upsert_at(slot* s, K k, F f) {
+    Backoff b;
+    while (true) {
+      unsigned int vn = s->version_num.load();
+      auto [cur, nxt] = find_in_slot(s, k);
+      std::optional<V> old;
+      if (nxt != nullptr) old = nxt->value;
+      std::optional<V> new_v = f(old);
+      if (!new_v.has_value()) return old;
+      V v = *new_v;
+      if (s->try_lock([=] {
+	    if (s->version_num.load() != vn) return false;
+	    if (nxt == nullptr) *cur = node_pool.new_obj(k, v, nullptr);
+	    else {
+	      *cur = node_pool.new_obj(k, v, nxt->next.load());
+	      node_pool.retire(nxt);
+	    }
+	    s->version_num = vn+1;
+	    return true;}))
+	return old;
+      b.wait();
+    }
+  }
+
+  template <typename F>
+  std::optional<V> upsert_f(Table& table, K k, F f) {
+    slot* s = get_slot(table, k);
+    return flck::with_epoch([&] {return upsert_at(s, k, f);});
+  }
+
 			
   Table empty(size_t n) {
     size_t size = (1ul << parlay::log2_up(n));
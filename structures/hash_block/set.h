@@ -1,43 +1,127 @@
 #include <parlay/primitives.h>
 #include <flock/flock.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #define Range_Search 1
 #define Dense_Keys 1
+#define Upsert 1
+
+template <typename K, typename V, typename Backoff = flck::default_backoff>
+struct Set : flck::upsert_ops<Set<K, V, Backoff>, K, V> {
+
+  struct KV {K key; V value;};
+
+  // Nodes with more than 3 entries keep a one byte fingerprint (tag)
+  // of each key, separate from the keys and values, so a lookup can
+  // compare all the tags of a node with one or two vector compares,
+  // and then only check the keys that match.  The tags are padded to
+  // the vector width.  Smaller nodes are just scanned.
+  static constexpr int tags_len(int size) {
+    return (size <= 3) ? 0 : ((size <= 16) ? 16 : 32);}
+
+  // the tag uses the high bits of the hash, the slot the low bits
+  static unsigned char get_tag(K k) {
+    return (unsigned char) ((k * 0x9ddfea08eb382d69ULL) >> 56);}
 
-template <typename K, typename V>
-struct Set {
+  // returns a bit mask of the positions in tags equal to t
+  template <int Len>
+  static unsigned int match_tags(const unsigned char* tags, unsigned char t) {
+#if defined(__AVX2__)
+    if constexpr (Len == 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i*) tags);
+      return (unsigned int) _mm256_movemask_epi8(
+		 _mm256_cmpeq_epi8(v, _mm256_set1_epi8((char) t)));
+    }
+#endif
+#if defined(__SSE2__)
+    unsigned int mask = 0;
+    __m128i tv = _mm_set1_epi8((char) t);
+    for (int j = 0; j < Len; j += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*) (tags + j));
+      mask |= ((unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, tv))) << j;
+    }
+    return mask;
+#else  // scalar fallback
+    unsigned int mask = 0;
+    for (int j = 0; j < Len; j++)
+      mask |= ((unsigned int) (tags[j] == t)) << j;
+    return mask;
+#endif
+  }
 
   template <int Size>
   struct Node {
     using node = Node<0>;
-    struct KV {K key; V value;};
     int cnt;
+    unsigned char tags[tags_len(Size)];
     KV entries[Size];
     int find(K k) {
-      for (int i=0; i < cnt; i++)
-	if (entries[i].key == k) return i;
-      return -1;
+      if constexpr (tags_len(Size) == 0) {
+	for (int i=0; i < cnt; i++)
+	  if (entries[i].key == k) return i;
+	return -1;
+      } else {
+	unsigned int mask = (match_tags<tags_len(Size)>(tags, get_tag(k))
+			     & ((1u << cnt) - 1));
+	while (mask != 0) {
+	  int i = __builtin_ctz(mask);
+	  if (entries[i].key == k) return i;
+	  mask &= mask - 1;
+	}
+	return -1;
+      }
+    }
+    void set(int i, KV kv) {
+      entries[i] = kv;
+      if constexpr (tags_len(Size) > 0) tags[i] = get_tag(kv.key);
     }
     Node(K k, V v) : cnt(1) { // could this overload with the other constructor if K is a pointer?
-      entries[0] = KV{k,v};
+      set(0, KV{k,v});
     }
     Node(node* old, K k, V v) {
       if (old == nullptr) cnt = 1;
       else {
 	cnt = old->cnt + 1;
+	KV* old_entries = entries_of(old);
 	for (int i=0; i < old->cnt; i++)
-	  entries[i] = ((Node<Size>*) old)->entries[i];
+	  set(i, old_entries[i]);
       }
-      entries[cnt-1] = KV{k,v};
+      set(cnt-1, KV{k,v});
+    }
+    // copy with kv.key given the value kv.value
+    Node(node* old, KV kv) : cnt(old->cnt) {
+      KV* old_entries = entries_of(old);
+      for (int i=0; i < cnt; i++)
+	set(i, (old_entries[i].key == kv.key) ? kv : old_entries[i]);
     }
     Node(node* old, K k) : cnt(old->cnt - 1) {
+      KV* old_entries = entries_of(old);
       for (int i=0, j=0; i < cnt; i++,j++) {
-	if (k == old->entries[i].key) j++;
-	entries[i] = ((Node<Size>*) old)->entries[j];
+	if (k == old_entries[i].key) j++;
+	set(i, old_entries[j]);
       }
     }
   };
   using node = Node<0>;
 
+  // The size of a node, and hence where its entries are, is
+  // determined by its count (see insert_to_node and remove_from_node).
+  template <typename F>
+  static auto with_node_size(node* x, F f) {
+    int cnt = x->cnt;
+    if (cnt <= 1) return f((Node<1>*) x);
+    else if (cnt <= 3) return f((Node<3>*) x);
+    else if (cnt <= 7) return f((Node<7>*) x);
+    else return f((Node<31>*) x);
+  }
+
+  static KV* entries_of(node* x) {
+    return with_node_size(x, [] (auto y) {return &(y->entries[0]);});}
+
+  static int find_in(node* x, K k) {
+    return with_node_size(x, [=] (auto y) {return y->find(k);});}
+
 #ifdef UseCAS
   struct slot {
 #else
@@ -82,6 +166,13 @@ struct Set {
     else return (node*) node_pool_31.new_obj(old, k);
   }
 
+  node* update_node(node* old, KV kv) {
+    if (old->cnt == 1) return (node*) node_pool_1.new_obj(old, kv);
+    else if (old->cnt <= 3) return (node*) node_pool_3.new_obj(old, kv);
+    else if (old->cnt <= 7) return (node*) node_pool_7.new_obj(old, kv);
+    else return (node*) node_pool_31.new_obj(old, kv);
+  }
+
   void retire_node(node* old) {
     if (old == nullptr);
     else if (old->cnt == 1) node_pool_1.retire((Node<1>*) old);
@@ -96,11 +187,10 @@ struct Set {
   std::optional<V> find_at(slot* s, K k) {
     node* x = s->ptr.load();
     if (x == nullptr) return {};
-    if (x->entries[0].key == k)
-      return x->entries[0].value;
-    int i = x->find(k);
-    if (i == -1) return {};
-    else return x->entries[i].value;
+    return with_node_size(x, [=] (auto y) -> std::optional<V> {
+	int i = y->find(k);
+	if (i == -1) return {};
+	else return y->entries[i].value;});
   }
   
   std::optional<V> find_(Table& table, K k) {
@@ -115,14 +205,11 @@ struct Set {
     return x;
   }
 
-  static constexpr int init_delay=200;
-  static constexpr int max_delay=2000;
-
   bool insert_at(slot* s, K k, V v) {
-    int delay = init_delay;
+    Backoff b;
     while (true) {
       node* x = s->ptr.load();
-      if (x != nullptr && x->find(k) != -1) return false;
+      if (x != nullptr && find_in(x, k) != -1) return false;
 #ifdef UseCAS
       node* new_node = insert_to_node(x, k, v);
       if(s->ptr.cas(x, new_node)) {
@@ -137,8 +224,7 @@ struct Set {
 	    return true;}))
 	return true;
 #endif
-      for (volatile int i=0; i < delay; i++);
-      delay = std::min(2*delay, max_delay);
+      b.wait();
     }
   }
 
@@ -148,10 +234,10 @@ struct Set {
   }
   
   bool remove_at(slot* s, K k) {
-    int delay = init_delay;
+    Backoff b;
     while (true) {
       node* x = s->ptr.load();
-      if (x == nullptr || x->find(k) == -1) return false;
+      if (x == nullptr || find_in(x, k) == -1) return false;
 #ifdef UseCAS
       node* new_node = remove_from_node(x, k);
       if(s->ptr.cas(x, new_node)) {
@@ -166,8 +252,7 @@ struct Set {
 	    return true;}))
 	return true;
 #endif      
-      for (volatile int i=0; i < delay; i++);
-      delay = std::min(2*delay, max_delay);
+      b.wait();
     }
   }
 
@@ -176,6 +261,46 @@ struct Set {
     return flck::with_epoch([&] {return remove_at(s, k);});
   }
 
+  // upsert_f on slot s.  Replaces the slot's node with a copy holding
+  // the new or changed entry, under the slot's lock (or with a CAS if
+  // UseCAS).
+  template <typename F>
+  std::optional<V> upsert_at(slot* s, K k, F f) {
+    Backoff b;
+    while (true) {
+      node* x = s->ptr.load();
+      int i = (x == nullptr) ? -1 : find_in(x, k);
+      std::optional<V> old;
+      if (i != -1) old = entries_of(x)[i].value;
+      std::optional<V> new_v = f(old);
+      if (!new_v.has_value()) return old;
+      V v = *new_v;
+      auto new_node = [=] {
+	return (i == -1) ? insert_to_node(x, k, v) : update_node(x, KV{k, v});};
+#ifdef UseCAS
+      node* n = new_node();
+      if (s->ptr.cas(x, n)) {
+	retire_node(x);
+	return old;
+      } else retire_node(n);
+#else
+      if (s->try_lock([=] {
+	    if (s->ptr.load() != x) return false;
+	    s->ptr = new_node();
+	    retire_node(x);
+	    return true;}))
+	return old;
+#endif
+      b.wait();
+    }
+  }
+
+  template <typename F>
+  std::optional<V> upsert_f(Table& table, K k, F f) {
+    slot* s = table.get_slot(k);
+    return flck::with_epoch([&] {return upsert_at(s, k, f);});
+  }
+
   template<typename AddF>
   void range_(Table& table, AddF& add, K start, K end) {
       for (K k = start; k <= end; k++) {
@@ -192,7 +317,7 @@ struct Set {
       node* x = table[i].ptr.load();
       if (x != nullptr)
 	for (int i = 0; i < x->cnt; i++)
-	  std::cout << x->entries[i].key << ", ";
+	  std::cout << entries_of(x)[i].key << ", ";
     }
     std::cout << std::endl;
   }
@@ -0,0 +1,361 @@
+#include <flock/flock.h>
+#include <parlay/primitives.h>
+
+// A hash table with chaining that grows and shrinks.  It is based on
+// structures/hash, but the buckets are kept in a table_version that
+// is replaced by one twice (or half) the size when the number of keys
+// gets too large (or too small).  The entries are migrated to the new
+// version a chunk of buckets at a time.  Any update that sees a
+// migration in progress helps by migrating a chunk, so no thread does
+// the full rehash.
+//
+// Migrating a bucket locks it, copies its list into the new version
+// and marks it as forwarded.  Operations that find a forwarded bucket
+// go to the new version.  Since a forwarded bucket is never modified
+// again, a find that reads it before it is forwarded still sees a
+// consistent state.
+
+template <typename K, typename V, typename Backoff = flck::retry_backoff>
+struct Set {
+
+  struct alignas(32) node {
+    K key;
+    V value;
+    flck::atomic<node*> next;
+    node(K key, V value, node* next) : key(key), value(value), next(next) {};
+  };
+
+  struct slot : flck::lock {
+    flck::atomic<node*> head;
+    flck::atomic<unsigned int> version_num;
+    flck::atomic_write_once<bool> forwarded; // moved to next version
+    slot() : head(nullptr), version_num(0), forwarded(false) {}
+  };
+
+  struct table_version {
+    parlay::sequence<slot> buckets;
+    size_t size;
+    // the version being migrated to, if any
+    flck::atomic<table_version*> next;
+    // the following are used to split the migration into chunks
+    std::atomic<bool> resizing;
+    std::atomic<size_t> chunks_claimed;
+    std::atomic<size_t> chunks_done;
+    std::vector<std::atomic<bool>> chunk_done;
+    table_version(size_t size)
+      : buckets(parlay::sequence<slot>(size)), size(size), next(nullptr),
+	resizing(false), chunks_claimed(0), chunks_done(0) {}
+  };
+
+  // The number of keys is kept approximately by per-thread counts that
+  // are summed every resize_check_frequency updates by a thread.
+  struct alignas(64) key_count {
+    std::atomic<long> count;
+    long updates;
+    key_count() : count(0), updates(0) {}
+  };
+
+  struct Table {
+    flck::atomic<table_version*> current;
+    std::vector<key_count> counts;
+    Table(table_version* tv)
+      : current(tv), counts(parlay::num_workers()) {}
+  };
+
+  // number of buckets moved by a single helper
+  static constexpr size_t chunk_size = 16;
+  static constexpr size_t min_size = 16;
+  static constexpr long resize_check_frequency = 64;
+
+  flck::memory_pool<node> node_pool;
+  flck::memory_pool<table_version> version_pool;
+
+  static size_t hash(K k) { return k * 0x9ddfea08eb382d69ULL;}
+
+  static slot* get_slot(table_version* tv, K k) {
+    return &tv->buckets[hash(k) & (tv->size-1u)];
+  }
+
+  // finds the slot for k following forwarded buckets
+  std::pair<table_version*, slot*> locate(Table* t, K k) {
+    table_version* tv = t->current.read();
+    slot* s = get_slot(tv, k);
+    while (s->forwarded.load()) {
+      tv = tv->next.read();
+      s = get_slot(tv, k);
+    }
+    return std::make_pair(tv, s);
+  }
+
+  auto find_in_slot(slot* s, K k) {
+    auto cur = &s->head;
+    node* nxt = cur->read();
+    while (nxt != nullptr && nxt->key != k) {
+      cur = &(nxt->next);
+      nxt = cur->read();
+    }
+    return std::make_pair(cur,nxt);
+  }
+
+  std::optional<V> find_(Table* t, K k) {
+    auto [tv, s] = locate(t, k);
+    auto [cur, nxt] = find_in_slot(s, k);
+    cur->validate();
+    if (nxt != nullptr) return nxt->value;
+    else return {};
+  }
+
+  std::optional<V> find(Table* t, K k) {
+    return flck::with_epoch([&] () -> std::optional<V> {
+	return find_(t, k);});
+  }
+
+  // ***************************
+  // Migration
+  // ***************************
+
+  void retire_list(node* ptr) {
+    while (ptr != nullptr) {
+      node* nxt = (ptr->next).load();
+      node_pool.retire(ptr);
+      ptr = nxt;
+    }
+  }
+
+  // Copies the nodes of the lists in ls with keys for which keep(key)
+  // is true into a new list.  Each helper makes its own copy without
+  // logging.  The first to commit its copy wins and the others free
+  // theirs.
+  template <typename Keep>
+  node* copy_lists(std::initializer_list<node*> ls, Keep keep) {
+    node* mine = nullptr;
+    node* r = flck::read_only<node*>([&] {
+	for (node* ptr : ls)
+	  for (; ptr != nullptr; ptr = ptr->next.load())
+	    if (keep(ptr->key))
+	      mine = node_pool.new_obj(ptr->key, ptr->value, mine);
+	return mine;});
+    if (r != mine)
+      flck::non_idempotent([&] {
+	while (mine != nullptr) {
+	  node* nxt = mine->next.load();
+	  node_pool.destruct(mine);
+	  mine = nxt;
+	}});
+    return r;
+  }
+
+  // Marks the bucket as forwarded.  Bumping the version number makes
+  // any update that read the bucket before it was forwarded fail.
+  static void forward(slot* s, unsigned int vn) {
+    s->forwarded = true;
+    s->version_num = vn + 1;
+  }
+
+  // Moves group g of tv into its next version.  When growing a group
+  // is bucket g, which moves to buckets g and g + tv->size.  When
+  // shrinking it is buckets g and g + nt->size, which both move to
+  // bucket g.  Returns false if it failed to acquire a lock.
+  bool migrate_group(table_version* tv, table_version* nt, size_t g) {
+    if (nt->size > tv->size) { // growing
+      slot* s = &tv->buckets[g];
+      return s->try_lock([=] {
+	  auto [forwarded, vn] = flck::load_all(s->forwarded, s->version_num);
+	  if (forwarded) return true;
+	  node* lst = s->head.load();
+	  size_t bit = tv->size;
+	  nt->buckets[g].head =
+	    copy_lists({lst}, [=] (K k) {return (hash(k) & bit) == 0;});
+	  nt->buckets[g + bit].head =
+	    copy_lists({lst}, [=] (K k) {return (hash(k) & bit) != 0;});
+	  forward(s, vn);
+	  flck::run_once([=] {retire_list(lst);});
+	  return true;});
+    } else { // shrinking
+      slot* s1 = &tv->buckets[g];
+      slot* s2 = &tv->buckets[g + nt->size];
+      return s1->try_lock([=] {
+	  auto [forwarded, vn1] = flck::load_all(s1->forwarded, s1->version_num);
+	  if (forwarded) return true;
+	  return s2->try_lock([=] {
+	      unsigned int vn2 = s2->version_num.load();
+	      node* l1 = s1->head.load();
+	      node* l2 = s2->head.load();
+	      nt->buckets[g].head = copy_lists({l1, l2}, [] (K k) {return true;});
+	      forward(s2, vn2);
+	      forward(s1, vn1);
+	      flck::run_once([=] {retire_list(l1); retire_list(l2);});
+	      return true;});});
+    }
+  }
+
+  static size_t num_groups(table_version* tv, table_version* nt) {
+    return std::min(tv->size, nt->size);
+  }
+
+  static size_t num_chunks(table_version* tv, table_version* nt) {
+    return (num_groups(tv, nt) + chunk_size - 1) / chunk_size;
+  }
+
+  // Starts replacing tv with a version of the given size, unless
+  // another thread already has.
+  void start_resize(table_version* tv, size_t new_size) {
+    if (tv->resizing.load() || tv->resizing.exchange(true)) return;
+    table_version* nt = version_pool.new_obj(new_size);
+    tv->chunk_done = std::vector<std::atomic<bool>>(num_chunks(tv, nt));
+    tv->next = nt;
+  }
+
+  // If a migration is in progress, migrates a chunk of it.  Chunks
+  // are handed out round robin so a chunk claimed by a stalled thread
+  // is eventually claimed again.  The thread that finishes the last
+  // chunk installs the new version.
+  void help_resize(Table* t) {
+    table_version* tv = t->current.load();
+    table_version* nt = tv->next.load();
+    if (nt == nullptr) return;
+    size_t n = num_chunks(tv, nt);
+    size_t c = tv->chunks_claimed.fetch_add(1) % n;
+    if (tv->chunk_done[c].load()) return;
+    size_t end = std::min((c + 1) * chunk_size, num_groups(tv, nt));
+    for (size_t g = c * chunk_size; g < end; g++) {
+      Backoff b;
+      while (!migrate_group(tv, nt, g)) b.wait();
+    }
+    if (!tv->chunk_done[c].exchange(true) &&
+	tv->chunks_done.fetch_add(1) + 1 == n) {
+      t->current = nt;
+      version_pool.retire(tv);
+    }
+  }
+
+  // Records an insert (delta = 1) or remove (delta = -1) and every so
+  // often checks if the table should grow or shrink.
+  void update_count(Table* t, long delta) {
+    auto& c = t->counts[parlay::worker_id()];
+    c.count.store(c.count.load(std::memory_order_relaxed) + delta,
+		  std::memory_order_relaxed);
+    if (++c.updates % resize_check_frequency != 0) return;
+    long total = 0;
+    for (auto& x : t->counts) total += x.count.load(std::memory_order_relaxed);
+    table_version* tv = t->current.load();
+    if (total > (long) tv->size) start_resize(tv, 2 * tv->size);
+    else if (8 * total < (long) tv->size && tv->size > min_size)
+      start_resize(tv, tv->size / 2);
+  }
+
+  // ***************************
+  // Updates
+  // ***************************
+
+  bool insert(Table* t, K k, V v) {
+    return flck::with_epoch([&] {
+      help_resize(t);
+      auto [tv, s] = locate(t, k);
+      Backoff b;
+      while (true) {
+	unsigned int vn = s->version_num.load();
+	if (s->forwarded.load()) {
+	  tv = tv->next.load();
+	  s = get_slot(tv, k);
+	  continue;
+	}
+	auto [cur, nxt] = find_in_slot(s, k);
+	if (nxt != nullptr) return false;
+	if (s->try_lock([=] {
+	      if (s->version_num.load() != vn) return false;
+	      *cur = node_pool.new_obj(k, v, nullptr);
+	      s->version_num = vn+1;
+	      return true;})) {
+	  update_count(t, 1);
+	  return true;
+	}
+	b.wait();
+      }});
+  }
+
+  bool remove(Table* t, K k) {
+    return flck::with_epoch([&] {
+      help_resize(t);
+      auto [tv, s] = locate(t, k);
+      Backoff b;
+      while (true) {
+	unsigned int vn = s->version_num.load();
+	if (s->forwarded.load()) {
+	  tv = tv->next.load();
+	  s = get_slot(tv, k);
+	  continue;
+	}
+	auto [cur, nxt] = find_in_slot(s, k);
+	if (nxt == nullptr) return false;
+	if (s->try_lock([=] {
+	      if (s->version_num.load() != vn) return false;
+	      *cur = nxt->next.load();
+	      node_pool.retire(nxt);
+	      s->version_num = vn+1;
+	      return true;})) {
+	  update_count(t, -1);
+	  return true;
+	}
+	b.wait();
+      }});
+  }
+
+  Table* empty(size_t n) {
+    size_t size = (1ul << parlay::log2_up(std::max(n, min_size)));
+    return new Table(version_pool.new_obj(2*size));
+  }
+
+  // finishes any migration in progress, only used when quiescent
+  void finish_resize(Table* t) {
+    flck::with_epoch([&] {
+      while (t->current.load()->next.load() != nullptr) help_resize(t);});
+  }
+
+  size_t size(Table* t) {
+    finish_resize(t);
+    return t->current.load()->size;
+  }
+
+  void print(Table* t) {
+    finish_resize(t);
+    table_version* tv = t->current.load();
+    for (size_t i=0; i < tv->size; i++) {
+      auto ptr = tv->buckets[i].head.load();
+      while (ptr != nullptr) {
+	std::cout << ptr->key << ", ";
+	ptr = (ptr->next).load();
+      }
+    }
+    std::cout << std::endl;
+  }
+
+  void retire(Table* t) {
+    finish_resize(t);
+    table_version* tv = t->current.load();
+    parlay::parallel_for (0, tv->size, [&] (size_t i) {
+	     retire_list(tv->buckets[i].head.load());});
+    version_pool.retire(tv);
+    delete t;
+  }
+
+  long check(Table* t) {
+    finish_resize(t);
+    table_version* tv = t->current.load();
+    auto s = parlay::tabulate(tv->size, [&] (size_t i) {
+	      node* ptr = tv->buckets[i].head.load();
+	      int cnt = 0;
+	      while (ptr != nullptr) {
+		cnt++;
+		ptr = (ptr->next).load();
+	      }
+	      return cnt;});
+    return parlay::reduce(s);
+  }
+
+  void clear() { node_pool.clear(); version_pool.clear();}
+  void reserve(size_t n) { node_pool.reserve(n);}
+  void shuffle(size_t n) { node_pool.shuffle(n);}
+  void stats() { node_pool.stats();}
+
+};
@@ -1,7 +1,24 @@
 #include <flock/flock.h>
+#include <parlay/primitives.h>
+#include "../blockleaftree/rebalance.h"
+#define Bulk_Build 1
+#define Upsert 1
 
-template <typename K, typename V>
-struct Set {
+// With BALANCED internal nodes are kept in heap order of a hash of
+// their keys (a treap), so the tree stays O(log n) deep even when keys
+// are inserted in sorted order.
+#ifdef BALANCED
+bool balanced = true;
+#else
+bool balanced = false;
+#endif
+
+template <typename K_, typename V_, typename Backoff = flck::retry_backoff>
+struct Set : flck::upsert_ops<Set<K_, V_, Backoff>, K_, V_> {
+  using K = K_;
+  using V = V_;
+
+  struct KV {K key; V value;};
 
   // common header for internal nodes and leaves
   struct header {
@@ -34,6 +51,9 @@ struct Set {
   flck::memory_pool<node> node_pool;
   flck::memory_pool<leaf> leaf_pool;
 
+  Rebalance<Set> balance;
+  Set() : balance(this) {}
+
   size_t max_iters = 10000000;
   
   auto find_location(node* root, K k) {
@@ -52,34 +72,51 @@ struct Set {
     return std::make_tuple(gp, gp_left, p, p_left, l);
   }
   
-  bool insert(node* root, K k, V v, bool upsert=false) {
+  // upsert_f for flck::upsert_ops.  Either way it takes just the
+  // parent's lock.
+  template <typename F>
+  std::optional<V> upsert_f(node* root, K k, F f) {
     return flck::with_epoch([=] {
-      node* prev_leaf = nullptr;
+      Backoff b;
       while (true) {
 	auto [gp, gp_left, p, p_left, l] = find_location(root, k);
-	if (!l->is_sentinal &&
-	    ((!upsert && l->key == k) ||
-	     (upsert && prev_leaf != nullptr && prev_leaf->key == k &&
-	      l != prev_leaf)))
-	  return false;
-	prev_leaf = l;
+	bool present = !l->is_sentinal && l->key == k;
+	std::optional<V> old;
+	if (present) old = ((leaf*) l)->value;
+	std::optional<V> new_v = f(old);
+	if (!new_v.has_value()) return old;
+	V v = *new_v;
 	auto r = p->try_lock([=] {
 	      auto ptr = p_left ? &(p->left) : &(p->right);
 	      auto l_new = ptr->load();
 	      if (p->removed.load() || l_new != l) return false;
 	      node* new_l = (node*) leaf_pool.new_obj(k, v);
-	      if (k == l->key) *ptr = new_l; // update existing key (only if upsert)
-	      else *ptr = ((l->is_sentinal || k > l->key) ?
-			   node_pool.new_obj(k, l, new_l) :
-			   node_pool.new_obj(l->key, new_l, l));
+	      if (present) { // replace the leaf
+		*ptr = new_l;
+		leaf_pool.retire((leaf*) l);
+	      } else *ptr = ((l->is_sentinal || k > l->key) ?
+			     node_pool.new_obj(k, l, new_l) :
+			     node_pool.new_obj(l->key, new_l, l));
 	      return true;});
-	if (r) return (k != l->key);
+	if (r) {
+	  if (!present && balanced) balance.rebalance(p, root, k);
+	  return old;
+	}
+	b.wait();
       }});
   }
 
+  // returns false and does no update if already in tree
+  bool insert(node* root, K k, V v) {
+    return !upsert_f(root, k, [=] (std::optional<V> old) -> std::optional<V> {
+	if (old.has_value()) return {};
+	else return v;}).has_value();
+  }
+
   bool remove(node* root, K k) {
     return flck::with_epoch([=] {
        node* prev_leaf = nullptr;
+       Backoff b;
        while (true) {
 	 auto [gp, gp_left, p, p_left, l] = find_location(root, k);
 	 if (l->is_sentinal || k != l->key ||
@@ -100,6 +137,7 @@ struct Set {
 		   leaf_pool.retire((leaf*) l);
 		   return true; });}))
 	   return true;
+	 b.wait();
        }}); 
   }
 
@@ -125,6 +163,37 @@ struct Set {
   }
 
   node* empty(size_t n) { return empty(); }
+
+  // Builds a perfectly balanced tree from key-value pairs in any
+  // order, keeping the first of any duplicate keys.  With BALANCED the
+  // key with the highest priority is used as the root of each subtree
+  // instead of the middle one, giving a treap.  The two halves of
+  // each subtree are built in parallel.
+  node* build(parlay::sequence<KV> kvs) {
+    auto a = flck::sort_unique_keys(std::move(kvs));
+
+    // leaf i is the sentinal for i = 0, and a[i-1] otherwise
+    std::function<node*(size_t, size_t)> build_rec;
+    build_rec = [&] (size_t start, size_t end) -> node* {
+      if (end - start == 1)
+	return (node*) ((start == 0) ? leaf_pool.new_obj()
+			: leaf_pool.new_obj(a[start-1].key, a[start-1].value));
+      size_t mid = (start + end) / 2;
+      if (balanced) { // a[mid-1] has the highest priority of a[start,end-1)
+	auto pri = parlay::delayed_tabulate(end - 1 - start, [&] (size_t i) {
+	    return parlay::hash64_2(a[start + i].key);});
+	mid = start + 1 + (parlay::max_element(pri) - pri.begin());
+      }
+      node *l, *r;
+      if (end - start < 1000) {
+	l = build_rec(start, mid);
+	r = build_rec(mid, end);
+      } else parlay::par_do([&] () { l = build_rec(start, mid);},
+			    [&] () { r = build_rec(mid, end);});
+      return node_pool.new_obj(a[mid-1].key, l, r);
+    };
+    return node_pool.new_obj(build_rec(0, a.size() + 1));
+  }
   
   void print(node* p) {
     std::function<void(node*)> prec;
@@ -174,6 +243,7 @@ struct Set {
 			    [&] () { std::tie(rmin,rmax,rsum) = crec((p->right).load());});
 	     if ((lsum !=0 && lmax >= p->key) || rmin < p->key)
 	       std::cout << "out of order key: " << lmax << ", " << p->key << ", " << rmin << std::endl;
+	     if (balanced) balance.check_balance(p, p->left.load(), p->right.load());
 	     if (lsum == 0) return rtup(p->key, rmax, rsum);
 	     else return rtup(lmin, rmax, lsum + rsum);
 	   };
@@ -1,7 +1,7 @@
 #define Range_Search 1
 #include <flock/flock.h>
 
-template <typename K, typename V>
+template <typename K, typename V, typename Backoff = flck::default_backoff>
 struct Set {
 
   struct alignas(32) node {
@@ -36,12 +36,9 @@ struct Set {
     return std::make_pair(cur, nxt);
   }
 
-  static constexpr int init_delay = 200;
-  static constexpr int max_delay = 2000;
-
   bool insert(node* root, K k, V v) {
     return flck::with_epoch([=] {
-      int delay = init_delay;
+      Backoff b;
       while (true) {
 	auto [cur, nxt] = find_location(root, k);
 	if (!nxt->is_end && nxt->key == k) return false; //already there
@@ -52,14 +49,13 @@ struct Set {
 		return true;
 	      } else return false;}))
 	  return true;
-	for (volatile int i=0; i < delay; i++);
-	delay = std::min(2*delay, max_delay);
+	b.wait();
       }});
   }
 
   bool remove(node* root, K k) {
     return flck::with_epoch([=] {
-      int delay = init_delay;
+      Backoff b;
       while (true) {
 	auto [cur, nxt] = find_location(root, k);
 	if (nxt->is_end || k != nxt->key) return false; // not found
@@ -84,8 +80,7 @@ struct Set {
 #endif
 	    });}))
 	  return true;
-	for (volatile int i=0; i < delay; i++);
-	delay = std::min(2*delay, max_delay);
+	b.wait();
       }
     });
   }
@@ -13,7 +13,7 @@
 #include <flock/flock.h>
 #include <parlay/primitives.h>
 
-template <typename K, typename V>
+template <typename K, typename V, typename Backoff = flck::default_backoff>
 struct Set {
 
   struct alignas(32) node {
@@ -45,12 +45,9 @@ struct Set {
     return std::make_tuple(prev,cur, nxt);
   }
 
-  static constexpr int init_delay = 200;
-  static constexpr int max_delay = 2000;
-
   bool insert(node* root, K k, V v) {
     return flck::with_epoch([=] {
-      int delay = init_delay;
+      Backoff b;
       while (true) {
 	auto [prev, cur, nxt] = find_location(root, k);
 	if (!nxt->is_end && nxt->key == k) return false; //already there
@@ -63,14 +60,13 @@ struct Set {
 	      cur->next = new_node; // splice in
 	      return true;
 	    })) return true;
-	for (volatile int i=0; i < delay; i++);
-	delay = std::min(2*delay, max_delay);
+	b.wait();
       }});
   }
 
   bool remove(node* root, K k) {
     return flck::with_epoch([=] {
-      int delay = init_delay;
+      Backoff b;
       while (true) {		 
 	auto [prev, cur, nxt] = find_location(root, k);
 	if (nxt->is_end || k != nxt->key) return false; // not found
@@ -87,8 +83,7 @@ struct Set {
 	      node_pool.retire(nxt);
 	      return true;
 	    })) return true;
-	for (volatile int i=0; i < delay; i++);
-	delay = std::min(2*delay, max_delay);
+	b.wait();
       }});
   }
 